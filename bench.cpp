@@ -0,0 +1,222 @@
+#include <buddy.h>
+#include <saferef.h>
+#include <execution.h>
+#include <func.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Micro benchmarks for the buddy allocator and interpreter; build with
+// optimisation (eg `make bench OPTFLAGS=-O2`) for meaningful numbers.
+
+template<typename Fn>
+static void bench(const std::string& name, int iters, Fn&& fn)
+{
+    fn(); // warm up
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iters; ++i) fn();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << strprintf("%-24s %8d iters %10.3f ms %12.1f ns/iter", name, iters, elapsed.count(), elapsed.count() * 1e6 / iters) << std::endl;
+}
+
+static void bench_alloc(Buddy::Allocator& alloc, const std::string& prefix)
+{
+    bench(prefix + "cons_list_100k", 20, [&]() {
+        Buddy::Ref r = alloc.nil();
+        for (int i = 0; i < 100000; ++i) {
+            r = alloc.create_cons(alloc.nil(), std::move(r));
+        }
+        alloc.deref(std::move(r));
+    });
+
+    bench(prefix + "atom_list_100k", 20, [&]() {
+        Buddy::Ref r = alloc.nil();
+        for (int i = 0; i < 100000; ++i) {
+            r = alloc.create_cons(alloc.create(i + 1000), std::move(r));
+        }
+        alloc.deref(std::move(r));
+    });
+
+    // random sizes freed in random order, so buddies rarely merge immediately
+    std::mt19937 rng{42};
+    std::vector<Buddy::Ref> pool(20000, Buddy::NULLREF);
+    static const std::string text(120, 'x');
+    bench(prefix + "mixed_sizes_200k", 5, [&]() {
+        for (int i = 0; i < 200000; ++i) {
+            auto& slot = pool[rng() % pool.size()];
+            alloc.deref(std::move(slot));
+            slot = alloc.create(std::string_view{text}.substr(0, 2 + rng() % 118));
+        }
+    });
+    for (auto& r : pool) alloc.deref(std::move(r));
+
+    // atoms too big to fit inline in a 128 byte chunk
+    static const std::string large(4096, 'y');
+    std::vector<Buddy::Ref> large_pool(2000, Buddy::NULLREF);
+    bench(prefix + "large_atoms_50k", 5, [&]() {
+        for (int i = 0; i < 50000; ++i) {
+            auto& slot = large_pool[rng() % large_pool.size()];
+            alloc.deref(std::move(slot));
+            slot = alloc.create(std::string_view{large}.substr(0, 124 + rng() % 3972));
+        }
+    });
+    for (auto& r : large_pool) alloc.deref(std::move(r));
+
+    // substrings of a large atom, sharing its data unless interning
+    Buddy::Ref parent = alloc.create(std::string_view{large});
+    std::vector<Buddy::Ref> slice_pool(2000, Buddy::NULLREF);
+    bench(prefix + "slices_50k", 5, [&]() {
+        for (int i = 0; i < 50000; ++i) {
+            auto& slot = slice_pool[rng() % slice_pool.size()];
+            alloc.deref(std::move(slot));
+            slot = alloc.create_slice(parent, rng() % 2048, 28 + rng() % 2000);
+        }
+    });
+    for (auto& r : slice_pool) alloc.deref(std::move(r));
+    alloc.deref(std::move(parent));
+}
+
+// longest single pause while dropping a large tree, all at once or in slices
+static void bench_drop(Buddy::Allocator& alloc)
+{
+    auto build = [&]() {
+        Buddy::Ref r = alloc.nil();
+        for (int i = 0; i < 1000000; ++i) r = alloc.create_cons(alloc.create(i), std::move(r));
+        return r;
+    };
+    using clock = std::chrono::steady_clock;
+    std::chrono::duration<double, std::milli> worst{};
+
+    Buddy::Ref r = build();
+    auto start = clock::now();
+    alloc.deref(std::move(r));
+    worst = clock::now() - start;
+    std::cout << strprintf("%-24s %10.3f ms max pause", "drop_1m", worst.count()) << std::endl;
+
+    r = build();
+    alloc.SetDeferredFree(true);
+    alloc.deref(std::move(r));
+    worst = {};
+    size_t slices{0};
+    while (alloc.HasPendingFree()) {
+        start = clock::now();
+        alloc.Collect(4096);
+        worst = std::max<std::chrono::duration<double, std::milli>>(worst, clock::now() - start);
+        ++slices;
+    }
+    alloc.SetDeferredFree(false);
+    std::cout << strprintf("%-24s %10.3f ms max pause %8d slices", "collect_1m_4096", worst.count(), slices) << std::endl;
+}
+
+// the allocator calls an interpreter step makes on its operands, over a
+// shuffled mix of tags and sizes
+static void bench_dispatch(Buddy::Allocator& alloc)
+{
+    std::mt19937 rng{42};
+    static const std::string text(100, 'x');
+    std::vector<Buddy::Ref> refs;
+    for (int i = 0; i < 1000; ++i) {
+        switch (rng() % 4) {
+        case 0: refs.push_back(alloc.create_cons(alloc.nil(), alloc.nil())); break;
+        case 1: refs.push_back(alloc.create(std::string_view{text}.substr(0, 4 + rng() % 96))); break;
+        case 2: refs.push_back(alloc.create(std::string_view{text})); break;
+        default: refs.push_back(alloc.create(i + 1000000000)); break;
+        }
+    }
+    size_t seen{0};
+    bench("dispatch_step_1000", 2000, [&]() {
+        for (Buddy::Ref r : refs) {
+            Buddy::Ref copy = alloc.bumpref(r);
+            if (!alloc.is_error(copy) && !alloc.is_funcy(copy)) seen += alloc.refs(copy);
+            alloc.deref(std::move(copy));
+        }
+    });
+    if (seen == 0) std::cout << "no refs seen" << std::endl;
+    for (auto& r : refs) alloc.deref(std::move(r));
+}
+
+static void bench_eval(Buddy::Allocator& raw_alloc)
+{
+    SafeAllocator alloc(raw_alloc);
+    constexpr auto q = Buddy::quote;
+    auto list = [&](auto&&... a) { return alloc.create_list(std::forward<decltype(a)>(a)...); };
+
+    auto run_in = [&](SafeRef&& sexpr, SafeRef&& env) {
+        Execution::Program program{alloc, std::move(sexpr), std::move(env)};
+        program.run();
+    };
+    auto run = [&](SafeRef&& sexpr) { run_in(std::move(sexpr), list()); };
+
+    bench("eval_add_1000", 200, [&]() {
+        SafeRef sexpr = alloc.nil();
+        for (int i = 0; i < 1000; ++i) sexpr = alloc.cons(alloc.create(q(i)), std::move(sexpr));
+        run(alloc.cons(alloc.create(OP_ADD), std::move(sexpr)));
+    });
+
+    // env references resolve without a BLLEVAL step of their own
+    bench("eval_add_env_1000", 200, [&]() {
+        SafeRef sexpr = alloc.nil();
+        for (int i = 0; i < 1000; ++i) sexpr = alloc.cons(alloc.create(1), std::move(sexpr));
+        run_in(alloc.cons(alloc.create(OP_ADD), std::move(sexpr)), alloc.create(3));
+    });
+
+    // totals too big to be immediates, kept unboxed between steps
+    bench("eval_add_big_1000", 200, [&]() {
+        SafeRef sexpr = alloc.nil();
+        for (int i = 0; i < 1000; ++i) sexpr = alloc.cons(alloc.create(q((int64_t{1} << 40) + i)), std::move(sexpr));
+        run(alloc.cons(alloc.create(OP_ADD), std::move(sexpr)));
+    });
+
+    // each argument extends a rope rather than copying what came before
+    static const std::string piece(200, 'c');
+    bench("eval_cat_1000", 200, [&]() {
+        SafeRef sexpr = alloc.nil();
+        for (int i = 0; i < 1000; ++i) sexpr = alloc.cons(alloc.create(q(std::string_view{piece})), std::move(sexpr));
+        run(alloc.cons(alloc.create(OP_CAT), std::move(sexpr)));
+    });
+
+    // the accumulated state is the step's only reference, so is updated in place
+    static const std::string wide(4000, 'w');
+    bench("eval_xor_1000", 50, [&]() {
+        SafeRef sexpr = alloc.nil();
+        for (int i = 0; i < 1000; ++i) sexpr = alloc.cons(alloc.create(q(std::string_view{wide})), std::move(sexpr));
+        run(alloc.cons(alloc.create(OP_XOR_BYTES), std::move(sexpr)));
+    });
+
+    // each argument lands in the func's own slots, without a cons per argument
+    bench("eval_nested_if", 200, [&]() {
+        SafeRef sexpr = alloc.create(q(1));
+        for (int i = 0; i < 500; ++i) sexpr = list(OP_IF, q(i), std::move(sexpr), q(list(i, i)));
+        run(std::move(sexpr));
+    });
+
+    bench("eval_nested_rc", 200, [&]() {
+        SafeRef sexpr = alloc.create(q(1));
+        for (int i = 0; i < 500; ++i) sexpr = list(OP_RC, q(i), std::move(sexpr), list(OP_HEAD, q(list(i, i))));
+        run(std::move(sexpr));
+    });
+}
+
+int main(void)
+{
+    Buddy::Allocator alloc;
+    bench_alloc(alloc, "");
+    bench_drop(alloc);
+    bench_dispatch(alloc);
+    bench_eval(alloc);
+    std::cout << Buddy::to_string(alloc.GetStats()) << std::endl;
+
+    Buddy::Allocator intern_alloc;
+    intern_alloc.SetInterning(true);
+    bench_alloc(intern_alloc, "intern_");
+    std::cout << Buddy::to_string(intern_alloc.GetStats()) << std::endl;
+
+    Buddy::Allocator thp_alloc{Buddy::HugePages::TRANSPARENT};
+    thp_alloc.Reserve(16);
+    bench_alloc(thp_alloc, "thp_");
+    std::cout << Buddy::to_string(thp_alloc.GetStats()) << std::endl;
+    return 0;
+}
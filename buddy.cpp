@@ -1,7 +1,18 @@
 #include <buddy.h>
 
+#include <algorithm>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cstddef>
 #include <cstdlib>
+#include <cstring>
+#include <new>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 
 // from crypto/hex_base.cpp
@@ -37,68 +48,538 @@ static std::string HexStr(const Span<const uint8_t> s)
 
 namespace Buddy {
 
-Allocator::Allocator()
+Allocator::Allocator(HugePages huge_pages) : Allocator(nullptr, huge_pages) { }
+
+Allocator::Allocator(std::shared_ptr<const Prelude> prelude, HugePages huge_pages)
+    : m_huge_pages{huge_pages}, m_prelude{std::move(prelude)}
 {
-    constexpr std::array<const uint8_t,1> data{{1}};
-    _nilone[0] = create<Tag::INPLACE_ATOM,16>(std::span(data).subspan(0, 0));
-    _nilone[1] = create<Tag::INPLACE_ATOM,16>(std::span(data).subspan(0, 1));
+    // over-reserve, then trim to an EXTENT_SIZE aligned range
+    constexpr size_t len{RESERVED_SIZE + EXTENT_SIZE};
+    void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+    std::byte* start = static_cast<std::byte*>(p);
+    std::byte* base = start + (-reinterpret_cast<uintptr_t>(start) & (EXTENT_SIZE - 1));
+    if (base > start) munmap(start, base - start);
+    munmap(base + RESERVED_SIZE, start + len - (base + RESERVED_SIZE));
+    m_base = reinterpret_cast<Chunk*>(base);
+
+    if (m_huge_pages != HugePages::NONE) madvise(base, RESERVED_SIZE, MADV_HUGEPAGE);
+
+    p = mmap(nullptr, IMMEDIATES_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        munmap(base, RESERVED_SIZE);
+        throw std::bad_alloc();
+    }
+    m_immediates = static_cast<Chunk*>(p);
+
+    if (m_prelude) {
+        const size_t prelude_len{m_prelude->m_blocks * BLOCK_SIZE};
+        if (prelude_len > 0 && mmap(base, prelude_len, PROT_READ, MAP_SHARED | MAP_FIXED, m_prelude->m_fd, 0) == MAP_FAILED) {
+            munmap(base, RESERVED_SIZE);
+            munmap(m_immediates, IMMEDIATES_SIZE);
+            throw std::bad_alloc();
+        }
+        m_block_count = m_prelude->m_blocks;
+        m_prelude_end = m_block_count * CHUNK_COUNT;
+        m_hugetlb.assign((m_block_count + EXTENT_BLOCKS - 1) / EXTENT_BLOCKS, false);
+        m_bitmaps.resize(m_block_count);
+        m_decommitted_block.assign(m_block_count, false);
+        m_region_block.assign(m_block_count, false);
+    }
 }
 
-Ref Allocator::TakeFree(Ref ref)
+Allocator::~Allocator()
 {
-    Ref result = NULLREF;
-    Chunk* chunk = GetChunk(ref);
-    if (chunk->info().next != ref) {
-        Chunk* next = GetChunk(chunk->info().next);
-        Chunk* prev = GetChunk(chunk->info().prev);
-        next->info().prev = chunk->info().prev;
-        prev->info().next = chunk->info().next;
-        result = prev->info().next;
+    munmap(m_base, RESERVED_SIZE);
+    munmap(m_immediates, IMMEDIATES_SIZE);
+    if (!m_snapshot_data.empty()) munmap(const_cast<uint8_t*>(m_snapshot_data.data()), m_snapshot_data.size());
+}
+
+std::optional<Shift16> Allocator::FreeSizeAt(Ref ref) const
+{
+    for (uint8_t sh = 0; sh <= BLOCK_EXP.sh; ++sh) {
+        if (ref.chunk() & ((1u << sh) - 1)) break;
+        if (IsFree(ref, Shift16::FromInt(sh))) return Shift16::FromInt(sh);
     }
-    return result;
+    return std::nullopt;
 }
 
-void Allocator::MakeFree(Ref ref, Shift16 sz)
+void Allocator::SetFree(FreeIndex& index, Ref ref, Shift16 sz)
 {
-    Chunk* chunk = GetChunk(ref);
-    chunk->info().tag = TagInfo::Free(sz).tagbyte();
-    Ref next = m_free[sz.sh];
-    if (next.is_null()) {
-        chunk->info().prev = chunk->info().next = ref;
+    assert(&index == &IndexFor(ref.block()));
+    BlockBitmap& bm = m_bitmaps[ref.block()];
+    size_t idx = ref.chunk() >> sz.sh;
+    size_t word = idx / 64;
+    uint64_t& bits = bm.bits[BlockBitmap::OFFSET[sz.sh] + word];
+    assert(!((bits >> (idx % 64)) & 1));
+    bits |= uint64_t{1} << (idx % 64);
+    bm.summary[sz.sh][word / 64] |= uint64_t{1} << (word % 64);
+
+    const uint16_t level = 1u << sz.sh;
+    if (!(bm.levels & level)) {
+        bm.levels |= level;
+        index.blocks[sz.sh][ref.block() / 64] |= uint64_t{1} << (ref.block() % 64);
+        index.summary[sz.sh][ref.block() / 4096] |= uint64_t{1} << (ref.block() / 64 % 64);
+    }
+    if (index.count[sz.sh]++ == 0) index.levels |= level;
+    index.recent[sz.sh] = ref;
+}
+
+void Allocator::ClearFree(FreeIndex& index, Ref ref, Shift16 sz)
+{
+    assert(&index == &IndexFor(ref.block()));
+    BlockBitmap& bm = m_bitmaps[ref.block()];
+    size_t idx = ref.chunk() >> sz.sh;
+    size_t word = idx / 64;
+    uint64_t& bits = bm.bits[BlockBitmap::OFFSET[sz.sh] + word];
+    assert((bits >> (idx % 64)) & 1);
+    bits &= ~(uint64_t{1} << (idx % 64));
+
+    const uint16_t level = 1u << sz.sh;
+    if (--index.count[sz.sh] == 0) index.levels &= ~level;
+    if (bits != 0) return;
+
+    auto& summary = bm.summary[sz.sh];
+    summary[word / 64] &= ~(uint64_t{1} << (word % 64));
+    if (std::all_of(summary.begin(), summary.end(), [](uint64_t w) { return w == 0; })) bm.levels &= ~level;
+}
+
+Ref Allocator::FindFree(FreeIndex& index, Shift16 sz)
+{
+    assert(index.count[sz.sh] > 0);
+    if (Ref recent = index.recent[sz.sh]; !recent.is_null() && IsFree(recent, sz)) return recent;
+
+    const uint16_t level = 1u << sz.sh;
+    uint16_t block;
+    while (true) {
+        auto& summary = index.summary[sz.sh];
+        size_t summary_word = 0;
+        while (summary[summary_word] == 0) ++summary_word;
+        size_t blocks_word = summary_word * 64 + std::countr_zero(summary[summary_word]);
+        uint64_t& blocks = index.blocks[sz.sh][blocks_word];
+        block = blocks_word * 64 + std::countr_zero(blocks);
+        if (m_bitmaps[block].levels & level) break;
+        // stale: the block's last free chunk of this size has since been used
+        blocks &= blocks - 1;
+        if (blocks == 0) summary[summary_word] &= ~(uint64_t{1} << (blocks_word % 64));
+    }
+
+    const BlockBitmap& bm = m_bitmaps[block];
+    const auto& summary = bm.summary[sz.sh];
+    size_t summary_word = 0;
+    while (summary[summary_word] == 0) ++summary_word;
+    size_t word = summary_word * 64 + std::countr_zero(summary[summary_word]);
+    size_t idx = word * 64 + std::countr_zero(bm.bits[BlockBitmap::OFFSET[sz.sh] + word]);
+    return Ref{{.block = block, .chunk = static_cast<uint16_t>(idx << sz.sh)}};
+}
+
+Ref Allocator::NewBlock()
+{
+    uint16_t block;
+    if (!m_decommitted.empty()) {
+        // pages are faulted back in on first touch
+        block = m_decommitted.back();
+        m_decommitted.pop_back();
+        m_decommitted_block[block] = false;
+        // the block may be joining the region's index instead, where the
+        // main index's lazily cleared entries for it would be wrong
+        for (size_t sh = 0; sh < LEVELS; ++sh) {
+            if (Ref& recent = m_free.recent[sh]; !recent.is_null() && recent.block() == block) recent = NULLREF;
+            uint64_t& blocks = m_free.blocks[sh][block / 64];
+            blocks &= ~(uint64_t{1} << (block % 64));
+            if (blocks == 0) m_free.summary[sh][block / 4096] &= ~(uint64_t{1} << (block / 64 % 64));
+        }
     } else {
-        Chunk* chunknext = GetChunk(next);
-        Chunk* chunkprev = GetChunk(chunknext->info().prev);
-        chunk->info().prev = chunknext->info().prev;
-        chunknext->info().prev = ref;
-        chunkprev->info().next = ref;
-        chunk->info().next = next;
-        chunk->info().tag = TagInfo::Free(sz).tagbyte();
+        if (m_block_count >= MAX_BLOCKS) throw std::bad_alloc();
+        block = m_block_count++;
+        if (block % EXTENT_BLOCKS == 0) CommitExtent(block / EXTENT_BLOCKS);
+        m_bitmaps.emplace_back();
+        m_decommitted_block.push_back(false);
+        m_region_block.push_back(false);
+    }
+    if (m_region_open) {
+        m_region_block[block] = true;
+        m_region_blocks.push_back(block);
+    }
+    ++m_stats.blocks;
+    m_stats.high_water = std::max(m_stats.high_water, m_stats.blocks);
+    return Ref{{.block = block, .chunk = 0}};
+}
+
+void Allocator::CommitExtent(size_t extent)
+{
+    bool hugetlb{false};
+    if (m_huge_pages == HugePages::EXPLICIT) {
+        void* addr = GetChunk(Ref{{.block = static_cast<uint16_t>(extent * EXTENT_BLOCKS), .chunk = 0}});
+        constexpr int prot{PROT_READ | PROT_WRITE};
+        constexpr int flags{MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED};
+        hugetlb = mmap(addr, EXTENT_SIZE, prot, flags | MAP_HUGETLB, -1, 0) != MAP_FAILED;
+        if (!hugetlb) {
+            // a failed MAP_FIXED may leave a hole, so put ordinary pages back
+            if (mmap(addr, EXTENT_SIZE, prot, flags | MAP_NORESERVE, -1, 0) == MAP_FAILED) throw std::bad_alloc();
+        }
+    }
+    m_hugetlb.push_back(hugetlb);
+}
+
+void Allocator::DecommitBlock(uint16_t block)
+{
+    if (!m_hugetlb[block / EXTENT_BLOCKS]) {
+        madvise(GetChunk(Ref{{.block = block, .chunk = 0}}), BLOCK_SIZE, MADV_DONTNEED);
+    }
+    m_decommitted.push_back(block);
+    m_decommitted_block[block] = true;
+    --m_stats.blocks;
+}
+
+size_t Allocator::Trim(size_t keep)
+{
+    size_t released{0};
+    while (m_free.count[BLOCK_EXP.sh] > keep) {
+        Ref blk = FindFree(m_free, BLOCK_EXP);
+        ClearFree(m_free, blk, BLOCK_EXP);
+        DecommitBlock(blk.block());
+        ++released;
     }
-    m_free[sz.sh] = ref;
+    return released;
 }
 
-Ref Allocator::allocate(AllocShift16 sz)
+void Allocator::Reserve(size_t n)
 {
-    size_t best_free = sz.sh;
-    while (best_free < m_free.size() && m_free[best_free].is_null()) {
-        ++best_free;
+    static const size_t pagesize = sysconf(_SC_PAGESIZE);
+
+    assert(!m_region_open);
+    m_retain_empty = std::max(m_retain_empty, n);
+    while (m_stats.blocks < n) {
+        Ref blk = NewBlock();
+        volatile std::byte* mem = reinterpret_cast<std::byte*>(GetChunk(blk));
+        for (size_t off = 0; off < BLOCK_SIZE; off += pagesize) mem[off] = std::byte{0};
+        SetFree(m_free, blk, BLOCK_EXP);
     }
-    Ref blk{NULLREF};
-    if (best_free == m_free.size()) {
-        static_assert(std::tuple_size_v<decltype(m_free)> == BLOCK_EXP.sh + 1);
-        blk.block = m_blocks.size();
-        blk.chunk = 0;
-        m_blocks.emplace_back(std::make_unique<Block>());
-        MakeFree(blk, BLOCK_EXP);
-        --best_free;
+}
+
+// Snapshot layout: header, then the blocks starting at SNAPSHOT_ALIGN so
+// they can be mapped straight over the reservation, then bitmaps,
+// decommitted blocks, roots, atoms and stats, then the atom data, again
+// aligned so it can be mapped. Raw structs are written, so a snapshot is
+// only readable by the same build.
+namespace {
+constexpr std::array<char, 8> SNAPSHOT_MAGIC{'b', 'l', 'l', 's', 'n', 'a', 'p', '1'};
+constexpr size_t SNAPSHOT_ALIGN{BLOCK_SIZE};
+
+struct SnapshotHeader
+{
+    std::array<char, 8> magic;
+    uint32_t block_size;
+    uint32_t bitmap_size;
+    uint32_t stats_size;
+    uint32_t blocks;
+    uint32_t decommitted;
+    uint32_t roots;
+    uint32_t atoms;
+    uint64_t data_offset;
+    uint64_t data_size;
+};
+
+// an atom whose data lives at offset in the snapshot's data section
+struct SnapshotAtom
+{
+    uint32_t ref;
+    uint32_t size;
+    uint64_t offset;
+};
+
+bool WriteAt(int fd, uint64_t offset, const void* buf, size_t len)
+{
+    const std::byte* p = static_cast<const std::byte*>(buf);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) return false;
+        p += n;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool ReadAt(int fd, uint64_t offset, void* buf, size_t len)
+{
+    std::byte* p = static_cast<std::byte*>(buf);
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) return false;
+        p += n;
+        offset += n;
+        len -= n;
     }
-    blk = m_free[best_free];
-    m_free[best_free] = TakeFree(blk);
-    Shift16 blk_sz = Shift16::FromInt(best_free);
+    return true;
+}
+
+template<typename T>
+bool WriteVec(int fd, uint64_t& offset, const std::vector<T>& v)
+{
+    size_t len = v.size() * sizeof(T);
+    if (!WriteAt(fd, offset, v.data(), len)) return false;
+    offset += len;
+    return true;
+}
+
+template<typename T>
+bool ReadVec(int fd, uint64_t& offset, std::vector<T>& v, size_t count)
+{
+    v.resize(count);
+    size_t len = count * sizeof(T);
+    if (!ReadAt(fd, offset, v.data(), len)) return false;
+    offset += len;
+    return true;
+}
+} // namespace
+
+bool Allocator::SaveSnapshot(const std::string& path, std::span<const Ref> roots)
+{
+    assert(!m_region_open && !m_prelude);
+    Collect();
+    FlushCache();
+
+    std::vector<SnapshotAtom> atoms;
+    std::vector<std::span<const uint8_t>> atom_data;
+    uint64_t data_size{0};
+    bool supported{true};
+    for (uint16_t block = 0; block < m_block_count; ++block) {
+        if (IsDecommitted(block)) continue;
+        ForEachAllocated(block, [&](Ref ref) {
+            auto external = [&](std::span<const uint8_t> sp) {
+                atoms.push_back({ref.index, static_cast<uint32_t>(sp.size()), data_size});
+                atom_data.push_back(sp);
+                data_size += sp.size();
+            };
+            dispatch(ref, util::Overloaded(
+                [&](const TagView<Tag::OWNED_ATOM,16>& atomown) { external(atomown.span()); },
+                [&](const TagView<Tag::EXT_ATOM,16>& atomext) { external(atomext.span()); },
+                [&](const TagView<Tag::ERROR,16>&) { supported = false; },
+                [&](const TagView<Tag::FUNC_EXT,16>&) { supported = false; },
+                [](const auto&) { }
+            ));
+        });
+    }
+    if (!supported) return false;
+
+    std::vector<uint32_t> root_index;
+    for (Ref r : roots) root_index.push_back(r.index);
+
+    uint64_t offset = SNAPSHOT_ALIGN + m_block_count * BLOCK_SIZE;
+    SnapshotHeader header{
+        .magic = SNAPSHOT_MAGIC,
+        .block_size = BLOCK_SIZE,
+        .bitmap_size = sizeof(BlockBitmap),
+        .stats_size = sizeof(Stats),
+        .blocks = static_cast<uint32_t>(m_block_count),
+        .decommitted = static_cast<uint32_t>(m_decommitted.size()),
+        .roots = static_cast<uint32_t>(root_index.size()),
+        .atoms = static_cast<uint32_t>(atoms.size()),
+        .data_offset = 0,
+        .data_size = data_size,
+    };
+    uint64_t meta_size = m_bitmaps.size() * sizeof(BlockBitmap) + m_decommitted.size() * sizeof(uint16_t)
+                         + root_index.size() * sizeof(uint32_t) + atoms.size() * sizeof(SnapshotAtom) + sizeof(Stats);
+    header.data_offset = (offset + meta_size + SNAPSHOT_ALIGN - 1) & ~(SNAPSHOT_ALIGN - 1);
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = WriteAt(fd, 0, &header, sizeof(header));
+    // decommitted blocks are left as holes
+    for (uint16_t block = 0; ok && block < m_block_count; ++block) {
+        if (IsDecommitted(block)) continue;
+        ok = WriteAt(fd, SNAPSHOT_ALIGN + block * BLOCK_SIZE, GetChunk(Ref{{.block = block, .chunk = 0}}), BLOCK_SIZE);
+    }
+    ok = ok && WriteVec(fd, offset, m_bitmaps) && WriteVec(fd, offset, m_decommitted)
+         && WriteVec(fd, offset, root_index) && WriteVec(fd, offset, atoms)
+         && WriteAt(fd, offset, &m_stats, sizeof(Stats));
+    offset = header.data_offset;
+    for (size_t i = 0; ok && i < atom_data.size(); ++i) {
+        ok = WriteAt(fd, offset, atom_data[i].data(), atom_data[i].size());
+        offset += atom_data[i].size();
+    }
+    ok = ok && ftruncate(fd, offset) == 0;
+    return close(fd) == 0 && ok;
+}
+
+std::optional<std::vector<Ref>> Allocator::LoadSnapshot(const std::string& path)
+{
+    // nothing may have been allocated yet
+    assert(!m_region_open && !m_prelude);
+    assert(m_block_count == 0);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return std::nullopt;
+    auto fail = [&]() { close(fd); return std::nullopt; };
+
+    SnapshotHeader header;
+    if (!ReadAt(fd, 0, &header, sizeof(header))) return fail();
+    if (header.magic != SNAPSHOT_MAGIC || header.block_size != BLOCK_SIZE
+        || header.bitmap_size != sizeof(BlockBitmap) || header.stats_size != sizeof(Stats)
+        || header.blocks > MAX_BLOCKS) {
+        return fail();
+    }
+
+    uint64_t offset = SNAPSHOT_ALIGN + uint64_t{header.blocks} * BLOCK_SIZE;
+    std::vector<BlockBitmap> bitmaps;
+    std::vector<uint16_t> decommitted;
+    std::vector<uint32_t> root_index;
+    std::vector<SnapshotAtom> atoms;
+    Stats stats;
+    if (!ReadVec(fd, offset, bitmaps, header.blocks) || !ReadVec(fd, offset, decommitted, header.decommitted)
+        || !ReadVec(fd, offset, root_index, header.roots) || !ReadVec(fd, offset, atoms, header.atoms)
+        || !ReadAt(fd, offset, &stats, sizeof(Stats))
+        || std::any_of(decommitted.begin(), decommitted.end(), [&](uint16_t block) { return block >= header.blocks; })) {
+        return fail();
+    }
+
+    const uint8_t* data{nullptr};
+    if (header.data_size > 0) {
+        void* p = mmap(nullptr, header.data_size, PROT_READ, MAP_PRIVATE, fd, header.data_offset);
+        if (p == MAP_FAILED) return fail();
+        data = static_cast<const uint8_t*>(p);
+    }
+
+    // map the blocks elsewhere first, so a failure leaves the heap untouched;
+    // with no blocks committed yet, nothing can be backed by huge pages
+    const size_t len = header.blocks * BLOCK_SIZE;
+    void* blocks = len == 0 ? nullptr : mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, SNAPSHOT_ALIGN);
+    auto unmap_data = [&]() { if (data != nullptr) munmap(const_cast<uint8_t*>(data), header.data_size); };
+    if (blocks == MAP_FAILED) {
+        unmap_data();
+        return fail();
+    }
+    close(fd);
+    if (len > 0 && mremap(blocks, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, m_base) == MAP_FAILED) {
+        munmap(blocks, len);
+        unmap_data();
+        return std::nullopt;
+    }
+
+    m_tcache_count = 0;
+    m_block_count = header.blocks;
+    m_hugetlb.assign((m_block_count + EXTENT_BLOCKS - 1) / EXTENT_BLOCKS, false);
+    m_bitmaps = std::move(bitmaps);
+    m_region_block.assign(m_block_count, false);
+    m_decommitted = std::move(decommitted);
+    m_decommitted_block.assign(m_block_count, false);
+    for (uint16_t block : m_decommitted) m_decommitted_block[block] = true;
+    m_snapshot_data = std::span{data, header.data_size};
+    m_stats = stats;
+    m_stats.malloc_bytes = 0;
+
+    m_free = FreeIndex{};
+    for (uint16_t block = 0; block < m_block_count; ++block) {
+        const BlockBitmap& bm = m_bitmaps[block];
+        for (uint16_t levels = bm.levels; levels != 0; levels &= levels - 1) {
+            size_t sh = std::countr_zero(levels);
+            m_free.blocks[sh][block / 64] |= uint64_t{1} << (block % 64);
+            m_free.summary[sh][block / 4096] |= uint64_t{1} << (block / 64 % 64);
+            m_free.levels |= 1u << sh;
+            for (size_t w = BlockBitmap::OFFSET[sh]; w < BlockBitmap::OFFSET[sh + 1]; ++w) {
+                m_free.count[sh] += std::popcount(bm.bits[w]);
+            }
+        }
+    }
+
+    // data that lived outside the heap now lives in the mapped file
+    for (const SnapshotAtom& atom : atoms) {
+        Chunk* chunk = GetChunk(FromIndex(atom.ref));
+        CountLive(chunk->taginfo(), false);
+        auto& atomext = *TagViewAt<Tag::EXT_ATOM,16>(chunk);
+        atomext.size = atom.size;
+        atomext.data = data + atom.offset;
+        chunk->data[0] = TagInfo::Allocated(Tag::EXT_ATOM, 16).tagbyte();
+        CountLive(TagInfo::Allocated(Tag::EXT_ATOM, 16), true);
+    }
+
+    std::vector<Ref> roots;
+    for (uint32_t idx : root_index) roots.push_back(FromIndex(idx));
+    return roots;
+}
+
+std::shared_ptr<const Prelude> Prelude::Freeze(Allocator& alloc, std::vector<Ref> roots)
+{
+    assert(!alloc.m_region_open && !alloc.m_prelude);
+
+    // prelude chunks are read-only, so ropes can't be flattened later; hold
+    // a reference to each while flattening, as flattening one may free another
+    std::vector<Ref> ropes;
+    for (uint16_t block = 0; block < alloc.m_block_count; ++block) {
+        if (alloc.IsDecommitted(block)) continue;
+        alloc.ForEachAllocated(block, [&](Ref ref) {
+            if (alloc.GetChunk(ref)->data[0] == Allocator::TAGBYTE<Tag::ROPE,16>) ropes.push_back(alloc.bumpref(ref));
+        });
+    }
+    for (Ref ref : ropes) alloc.Flatten(ref);
+    for (Ref& ref : ropes) alloc.deref(std::move(ref));
+    alloc.FlushCache();
+
+    std::shared_ptr<Prelude> prelude{new Prelude};
+    prelude->m_blocks = alloc.m_block_count;
+    prelude->m_roots = std::move(roots);
+
+    prelude->m_fd = memfd_create("bll-prelude", MFD_CLOEXEC);
+    if (prelude->m_fd < 0 || ftruncate(prelude->m_fd, prelude->m_blocks * BLOCK_SIZE) != 0) throw std::bad_alloc();
+    for (uint16_t block = 0; block < prelude->m_blocks; ++block) {
+        if (alloc.IsDecommitted(block)) continue;
+        alloc.ForEachAllocated(block, [&](Ref ref) {
+            alloc.dispatch(ref, util::Overloaded(
+                [&](const TagView<Tag::OWNED_ATOM,16>& atomown) { prelude->m_external.push_back(atomown.data); },
+                [&](const TagView<Tag::FUNC_EXT,16>& func_ext) {
+                    if (func_ext.state != nullptr) prelude->m_external.push_back(const_cast<void*>(static_cast<const void*>(func_ext.state)));
+                },
+                [](const auto&) { }
+            ));
+        });
+        const void* mem = alloc.GetChunk(Ref{{.block = block, .chunk = 0}});
+        if (!WriteAt(prelude->m_fd, block * BLOCK_SIZE, mem, BLOCK_SIZE)) throw std::bad_alloc();
+    }
+    return prelude;
+}
+
+Prelude::~Prelude()
+{
+    for (void* p : m_external) std::free(p);
+    if (m_fd >= 0) close(m_fd);
+}
+
+void Allocator::RefillCache()
+{
+    Ref blk = AllocateBuddy(TCACHE_REFILL);
+    // lowest address on top, so consecutive allocations are adjacent
+    for (size_t i = TCACHE_REFILL.chunk_size(); i-- > 0; ) {
+        Ref r{blk};
+        r.index += i;
+        GetChunk(r)->data[0] = TagInfo::Free(Shift16{16}).tagbyte();
+        m_tcache[m_tcache_count++] = r;
+    }
+}
+
+void Allocator::FlushCache(size_t n)
+{
+    n = std::min(n, m_tcache_count);
+    for (size_t i = 0; i < n; ++i) ReleaseBuddy(m_tcache[i], Shift16{16});
+    std::copy(m_tcache.begin() + n, m_tcache.begin() + m_tcache_count, m_tcache.begin());
+    m_tcache_count -= n;
+}
+
+Ref Allocator::AllocateBuddy(Shift16 sz)
+{
+    FreeIndex& index = m_region_open ? m_region_free : m_free;
+    const uint16_t fits = ~((1u << sz.sh) - 1);
+    if (!(index.levels & fits)) {
+        SetFree(index, NewBlock(), BLOCK_EXP);
+    }
+    Shift16 blk_sz = Shift16::FromInt(std::countr_zero<uint16_t>(index.levels & fits));
+    Ref blk = FindFree(index, blk_sz);
+    ClearFree(index, blk, blk_sz);
 
     while (blk_sz.sh > sz.sh) {
         --blk_sz;
-        MakeFree(GetBuddy(blk, blk_sz), blk_sz);
+        SetFree(index, GetBuddy(blk, blk_sz), blk_sz);
     }
     return blk;
 }
@@ -106,58 +587,108 @@ Ref Allocator::allocate(AllocShift16 sz)
 void Allocator::deallocate(Ref&& ref)
 {
     Ref r = ref.take();
-    assert(r != _nilone[0]);
-    assert(r != _nilone[1]);
-    Shift16 sz{TagInfo{GetChunk(r)->data[0]}.size};
-    while (sz.sh < 8) {
+    assert(!IsStatic(r));
+    TagInfo tag{GetChunk(r)->taginfo()};
+    CountLive(tag, false);
+    Shift16 sz{tag.size};
+    GetChunk(r)->data[0] = TagInfo::Free(sz).tagbyte();
+    if (sz.sh == 0 && !m_region_block[r.block()]) {
+        if (m_tcache_count == TCACHE_SIZE) FlushCache(TCACHE_SIZE / 2);
+        m_tcache[m_tcache_count++] = r;
+        return;
+    }
+    ReleaseBuddy(r, sz);
+}
+
+void Allocator::ReleaseBuddy(Ref r, Shift16 sz)
+{
+    FreeIndex& index = IndexFor(r.block());
+    while (sz.sh < BLOCK_EXP.sh) {
         Ref buddy = GetBuddy(r, sz);
-        Chunk* chunk = GetChunk(buddy);
-        TagInfo buddytag{chunk->taginfo()};
-        if (buddytag.free && buddytag.size == sz) {
-            Ref buddynext = TakeFree(buddy);
-            if (m_free[sz.sh] == buddy) m_free[sz.sh] = buddynext;
-            if (buddy.chunk < r.chunk) r = buddy;
-            ++sz;
-        } else {
-            break;
-        }
+        if (!IsFree(buddy, sz)) break;
+        ClearFree(index, buddy, sz);
+        if (buddy.index < r.index) r = buddy;
+        ++sz;
+    }
+    SetFree(index, r, sz);
+    if (sz == BLOCK_EXP && &index == &m_free && m_free.count[BLOCK_EXP.sh] > m_retain_empty) {
+        Trim(m_retain_empty);
+    }
+}
+
+bool Allocator::DropShared(Ref r)
+{
+    if (IsStatic(r)) return true;
+    if (TagRefCount* trc = RefCountAt(r); trc != nullptr) {
+        auto rc = trc->refcount.read();
+        if (rc > 1) trc->refcount.write(rc - 1);
+        return rc > 1;
     }
-    MakeFree(r, sz);
+    // a NOREFCOUNT chunk only ever has the one reference
+    bool other_refs{true};
+    dispatch(r, util::Overloaded(
+        [&]<size_t SIZE>(const TagView<Tag::NOREFCOUNT,SIZE>&) { other_refs = false; },
+        [](const TagRefCount&) { }
+    ));
+    return other_refs;
 }
 
 void Allocator::_deref(Ref&& ref)
 {
+    if (m_deferred_free && !m_region_open) {
+        if (DropShared(ref)) return;
+        if (m_pending_work.is_null()) {
+            m_pending_work = ref;
+        } else {
+            // queued the same way FreeChain queues its second child
+            Ref link{allocate(16)};
+            set_at(link, TagView<Tag::CONS, 16>{.left=ref, .right=m_pending_todo});
+            CountLive(TagInfo::Allocated(Tag::CONS, 16), true);
+            m_pending_todo = link;
+        }
+        return;
+    }
+
     Ref work{ref};
     Ref todo{NULLREF};
+    FreeChain(work, todo, std::numeric_limits<size_t>::max());
+}
 
-    auto has_other_refs = [&](Ref r) -> bool {
-        bool other_refs{true};
-        dispatch(r, util::Overloaded(
-            [&]<size_t SIZE>(const TagView<Tag::NOREFCOUNT,SIZE>&) { other_refs = false; },
-            [&](const TagRefCount& trc) {
-                auto rc = trc.refcount.read();
-                if (rc > 1) {
-                    trc.refcount.write(rc - 1);
-                } else {
-                    other_refs = false;
-                }
-            }
-        ));
-        return other_refs;
-    };
+size_t Allocator::Collect(size_t budget)
+{
+    // pending frees are of the main heap, which a region has to itself
+    assert(!m_region_open);
+    return FreeChain(m_pending_work, m_pending_todo, budget);
+}
 
-    while (!work.is_null()) {
-        if (has_other_refs(work)) {
+size_t Allocator::FreeChain(Ref& work, Ref& todo, size_t budget)
+{
+    size_t freed{0};
+    if (work.is_null()) work = todo.take();
+    while (!work.is_null() && freed < budget) {
+        if (DropShared(work)) {
             work.set_null();
         } else {
+            if (IsInterned(work)) Unintern(work);
             Ref todo_a{NULLREF}, todo_b{NULLREF};
+            bool is_count{false};
+            std::array<Ref, 1 + TagView<Tag::FUNC_COUNT,32>::ARGS> count_live{make_filled_array<Ref, 1 + TagView<Tag::FUNC_COUNT,32>::ARGS>(NULLREF)};
+            size_t count_n{0};
             dispatch(work, util::Overloaded(
                 [&]<size_t SIZE>(const TagView<Tag::NOREFCOUNT,SIZE>&) { },
                 [&]<size_t SIZE>(const TagView<Tag::INPLACE_ATOM,SIZE>&) { },
                 [&](const TagView<Tag::OWNED_ATOM,16>& atomown) {
-                    std::free(const_cast<uint8_t*>(atomown.data));
+                    FreeExternal(atomown);
                 },
                 [&](const TagView<Tag::EXT_ATOM,16>&) { },
+                [&](const TagView<Tag::LARGE_ATOM,16>&) { },
+                [&](const TagView<Tag::SLICE,32>& slice) {
+                    todo_a = slice.parent;
+                },
+                [&](const TagView<Tag::ROPE,16>& rope) {
+                    todo_a = rope.left;
+                    todo_b = rope.right;
+                },
                 [&](const TagView<Tag::CONS,16>& cons) {
                     todo_a = cons.left;
                     todo_b = cons.right;
@@ -167,24 +698,62 @@ void Allocator::_deref(Ref&& ref)
                     todo_a = func.env;
                     todo_b = func.state;
                 },
-                [&](const TagView<Tag::FUNC_COUNT,16>& func_count) {
-                    todo_a = func_count.env;
-                    todo_b = func_count.state;
+                [&](const TagView<Tag::FUNC_COUNT,32>& func_count) {
+                    // children still to free are queued below, using the
+                    // chunk itself rather than allocating links
+                    is_count = true;
+                    auto keep = [&](Ref child) { if (!child.is_null() && !DropShared(child)) count_live[count_n++] = child; };
+                    keep(func_count.env);
+                    for (size_t i = 0; i < func_count.counter; ++i) keep(func_count.args[i]);
                 },
                 [&](const TagView<Tag::FUNC_EXT,16>& func_ext) {
-                    std::free(const_cast<void*>(func_ext.state));
+                    FreeExternal(func_ext);
                     todo_a = func_ext.env;
+                },
+                [&](const TagView<Tag::FUNC_NUM,16>& func_num) {
+                    todo_a = func_num.env;
                 }
             ));
-            if (!todo_a.is_null() && has_other_refs(todo_a)) todo_a.set_null();
-            if (!todo_b.is_null() && has_other_refs(todo_b)) todo_b.set_null();
+            if (is_count) {
+                if (count_n == count_live.size()) {
+                    // the two halves only hold three: keep the chunk, with
+                    // todo in place of its last arg, to come back to
+                    auto& func_count = *TagViewAt<Tag::FUNC_COUNT,32>(GetChunk(work));
+                    Ref last{func_count.args[func_count.ARGS - 1]};
+                    func_count.args[func_count.ARGS - 1] = todo;
+                    if (todo.is_null()) --func_count.counter;
+                    todo = work;
+                    work = last;
+                } else if (count_n >= 2) {
+                    // each 16 byte half becomes a cons linking a child onto todo
+                    Ref half{GetBuddy(work, Shift16{16})};
+                    CountLive(GetChunk(work)->taginfo(), false);
+                    set_at(half, TagView<Tag::CONS, 16>{.left=count_live[count_n - 1], .right=todo});
+                    set_at(work, TagView<Tag::CONS, 16>{.left=count_live[count_n - 2], .right=half});
+                    CountLive(TagInfo::Allocated(Tag::CONS, 16), true);
+                    CountLive(TagInfo::Allocated(Tag::CONS, 16), true);
+                    todo = work;
+                    work = (count_n == 3 ? count_live[0] : NULLREF);
+                } else {
+                    deallocate(std::move(work));
+                    ++freed;
+                    work = count_live[0];
+                }
+                if (work.is_null()) work = todo.take();
+                continue;
+            }
+            if (!todo_a.is_null() && DropShared(todo_a)) todo_a.set_null();
+            if (!todo_b.is_null() && DropShared(todo_b)) todo_b.set_null();
             if (todo_a.is_null() && !todo_b.is_null()) std::swap(todo_a, todo_b);
             if (todo_b.is_null()) {
                 deallocate(std::move(work));
+                ++freed;
                 work = todo_a;
             } else {
                 // todo_a and todo_b are not null, therefore size is 16, therefore convert to cons
+                CountLive(GetChunk(work)->taginfo(), false);
                 set_at(work, TagView<Tag::CONS, 16>{.left=todo_b, .right=todo});
+                CountLive(TagInfo::Allocated(Tag::CONS, 16), true);
                 todo = work;
                 work = todo_a;
             }
@@ -193,16 +762,391 @@ void Allocator::_deref(Ref&& ref)
             work = todo.take();
         }
     }
+    return freed;
 }
 
-Ref Allocator::create(int64_t n)
+void Allocator::BeginRegion()
+{
+    assert(!m_region_open);
+    m_region_open = true;
+}
+
+Ref Allocator::EndRegion(Ref&& result)
+{
+    assert(m_region_open);
+    m_region_open = false;
+
+    Ref res = Promote(result.take());
+    SweepRegion();
+
+    for (uint16_t block : m_region_blocks) {
+        m_region_block[block] = false;
+        m_bitmaps[block] = BlockBitmap{};
+        SetFree(m_free, Ref{{.block=block, .chunk=0}}, BLOCK_EXP);
+    }
+    m_region_blocks.clear();
+    m_region_free = FreeIndex{};
+    Trim(m_retain_empty);
+
+    return res;
+}
+
+Ref Allocator::Promote(Ref ref)
+{
+    if (!InRegion(ref)) return ref;
+
+    // region chunk -> copy in main heap; copies start with refcount 0 and
+    // gain a reference for every edge that points at them
+    std::unordered_map<uint32_t, Ref> copied;
+    auto mapped = [&](ShortRef sr) -> ShortRef {
+        Ref r{sr};
+        if (!InRegion(r)) return bumpref(r);
+        return bumpref(copied.at(sr.get_value()));
+    };
+
+    // post-order walk, so children are copied before their parents
+    std::vector<std::pair<Ref, bool>> todo{{ref, false}};
+    while (!todo.empty()) {
+        auto [r, expanded] = todo.back();
+        if (!InRegion(r) || copied.contains(ShortRef{r}.get_value())) {
+            todo.pop_back();
+            continue;
+        }
+        if (!expanded) {
+            todo.back().second = true;
+            dispatch(r, util::Overloaded(
+                [&](const TagView<Tag::CONS,16>& cons) {
+                    todo.emplace_back(cons.left, false);
+                    todo.emplace_back(cons.right, false);
+                },
+                [&](const TagView<Tag::SLICE,32>& slice) {
+                    todo.emplace_back(slice.parent, false);
+                },
+                [&](const TagView<Tag::ROPE,16>& rope) {
+                    todo.emplace_back(rope.left, false);
+                    todo.emplace_back(rope.right, false);
+                },
+                [&]<FuncyTagView FTV>(const FTV& func) {
+                    todo.emplace_back(func.env, false);
+                    if constexpr (requires { ShortRef{func.state}; }) {
+                        todo.emplace_back(func.state, false);
+                    }
+                    if constexpr (requires { func.args; }) {
+                        for (size_t i = 0; i < func.counter; ++i) todo.emplace_back(func.args[i], false);
+                    }
+                },
+                [](const auto&) { }
+            ));
+            continue;
+        }
+        todo.pop_back();
+
+        Shift16 sz{GetChunk(r)->taginfo().size};
+        Ref n = allocate(AllocShift16::FromInt(sz.sh));
+        std::copy_n(GetChunk(r), sz.chunk_size(), GetChunk(n));
+        CountLive(GetChunk(n)->taginfo(), true);
+        dispatch(r, util::Overloaded(
+            // the copy takes ownership of malloc'd data
+            [&](TagView<Tag::OWNED_ATOM,16>& atomown) { atomown.data = nullptr; },
+            [&](TagView<Tag::FUNC_EXT,16>& func_ext) { func_ext.state = nullptr; },
+            [](auto&) { }
+        ));
+        dispatch(n, util::Overloaded(
+            [&]<size_t SIZE>(TagView<Tag::NOREFCOUNT,SIZE>&) { },
+            [&](TagRefCount& trc) { trc.refcount.write(0); }
+        ));
+        dispatch(n, util::Overloaded(
+            [&](TagView<Tag::CONS,16>& cons) {
+                cons.left = mapped(cons.left);
+                cons.right = mapped(cons.right);
+            },
+            [&](TagView<Tag::SLICE,32>& slice) {
+                slice.parent = mapped(slice.parent);
+                slice.self = n;
+            },
+            [&](TagView<Tag::ROPE,16>& rope) {
+                rope.left = mapped(rope.left);
+                rope.right = mapped(rope.right);
+            },
+            [&]<FuncyTagView FTV>(FTV& func) {
+                func.env = mapped(func.env);
+                if constexpr (requires { func.state = mapped(func.state); }) {
+                    func.state = mapped(func.state);
+                }
+                if constexpr (requires { func.args; }) {
+                    for (size_t i = 0; i < func.counter; ++i) func.args[i] = mapped(func.args[i]);
+                }
+            },
+            [](auto&) { }
+        ));
+        copied.emplace(ShortRef{r}.get_value(), n);
+    }
+    return mapped(ref);
+}
+
+void Allocator::SweepRegion()
+{
+    auto drop = [&](Ref r) { if (!r.is_null() && !InRegion(r)) _deref(std::move(r)); };
+
+    for (uint16_t block : m_region_blocks) {
+        ForEachAllocated(block, [&](Ref ref) {
+            CountLive(GetChunk(ref)->taginfo(), false);
+            dispatch(ref, util::Overloaded(
+                [&](const TagView<Tag::OWNED_ATOM,16>& atomown) {
+                    FreeExternal(atomown);
+                },
+                [&](const TagView<Tag::CONS,16>& cons) {
+                    drop(cons.left);
+                    drop(cons.right);
+                },
+                [&](const TagView<Tag::SLICE,32>& slice) {
+                    drop(slice.parent);
+                },
+                [&](const TagView<Tag::ROPE,16>& rope) {
+                    drop(rope.left);
+                    drop(rope.right);
+                },
+                [&](const TagView<Tag::FUNC,16>& func) {
+                    drop(func.env);
+                    drop(func.state);
+                },
+                [&](const TagView<Tag::FUNC_COUNT,32>& func_count) {
+                    drop(func_count.env);
+                    for (size_t i = 0; i < func_count.counter; ++i) drop(func_count.args[i]);
+                },
+                [&](const TagView<Tag::FUNC_EXT,16>& func_ext) {
+                    FreeExternal(func_ext);
+                    drop(func_ext.env);
+                },
+                [&](const TagView<Tag::FUNC_NUM,16>& func_num) {
+                    drop(func_num.env);
+                },
+                [](const auto&) { }
+            ));
+        });
+    }
+}
+
+namespace {
+uint64_t AtomHash(std::span<const uint8_t> sp)
+{
+    return std::hash<std::string_view>{}(std::string_view{reinterpret_cast<const char*>(sp.data()), sp.size()});
+}
+
+uint64_t ConsHash(Ref left, Ref right)
+{
+    // children are interned too, so their refs stand for their contents
+    return std::hash<uint64_t>{}((uint64_t{ShortRef{left}.get_value()} << 32) | ShortRef{right}.get_value()) ^ 0x636f6e73;
+}
+} // namespace
+
+Ref Allocator::Intern(std::span<const uint8_t> sp)
+{
+    const uint64_t hash = AtomHash(sp);
+    auto it = m_intern.find(hash);
+    if (it != m_intern.end()) {
+        bool same{false};
+        dispatch(it->second, util::Overloaded(
+            [&]<AtomicTagView ATV>(const ATV& atv) { same = std::ranges::equal(atv.span(), sp); },
+            [](const auto&) { }
+        ));
+        if (same) return bumpref(it->second);
+        return create_fresh(sp);
+    }
+    Ref ref = create_fresh(sp);
+    AddInterned(hash, ref);
+    return ref;
+}
+
+Ref Allocator::InternCons(Ref&& left, Ref&& right)
 {
-    if (n == 0) return nil();
-    if (n == 1) return one();
-    std::array<uint8_t,9> v{0,0,0,0,0,0,0,0,0};;
+    const uint64_t hash = ConsHash(left, right);
+    auto it = m_intern.find(hash);
+    if (it != m_intern.end()) {
+        bool same{false};
+        dispatch(it->second, util::Overloaded(
+            [&](const TagView<Tag::CONS,16>& cons) { same = Ref{cons.left} == left && Ref{cons.right} == right; },
+            [](const auto&) { }
+        ));
+        if (same) {
+            deref(left.take());
+            deref(right.take());
+            return bumpref(it->second);
+        }
+    }
+    Ref ref = create<Buddy::Tag::CONS, 16>({.left=left.take(), .right=right.take()});
+    if (it == m_intern.end()) AddInterned(hash, ref);
+    return ref;
+}
+
+void Allocator::AddInterned(uint64_t hash, Ref ref)
+{
+    m_intern.emplace(hash, ref);
+    if (m_interned.size() <= ref.index) m_interned.resize(m_block_count * CHUNK_COUNT);
+    m_interned[ref.index] = true;
+}
+
+void Allocator::Unintern(Ref ref)
+{
+    m_interned[ref.index] = false;
+    uint64_t hash{0};
+    dispatch(ref, util::Overloaded(
+        [&]<AtomicTagView ATV>(const ATV& atv) { hash = AtomHash(atv.span()); },
+        [&](const TagView<Tag::CONS,16>& cons) { hash = ConsHash(cons.left, cons.right); },
+        [](const auto&) { }
+    ));
+    if (auto it = m_intern.find(hash); it != m_intern.end() && it->second == ref) m_intern.erase(it);
+}
+
+Allocator::CompactResult Allocator::Compact(std::span<Ref* const> roots)
+{
+    assert(!m_region_open);
+    const auto start = std::chrono::steady_clock::now();
+    CompactResult res;
+
+    Collect();
+    FlushCache();
+    m_free.recent = make_filled_array<Ref, LEVELS>(NULLREF);
+
+    // evacuate the emptiest blocks, up to half full, while their live
+    // chunks fit in the free space of the blocks that remain
+    const size_t first_block{m_prelude ? m_prelude->m_blocks : 0};
+    std::vector<std::pair<size_t, uint16_t>> candidates; // live bytes, block
+    size_t free_bytes{0};
+    for (size_t block = first_block; block < m_block_count; ++block) {
+        if (IsDecommitted(block)) continue;
+        size_t free{0};
+        for (size_t sh = 0; sh < LEVELS; ++sh) {
+            for (size_t w = BlockBitmap::OFFSET[sh]; w < BlockBitmap::OFFSET[sh + 1]; ++w) {
+                free += std::popcount(m_bitmaps[block].bits[w]) * Shift16::FromInt(sh).byte_size();
+            }
+        }
+        free_bytes += free;
+        if (free == BLOCK_SIZE || free < BLOCK_SIZE / 2) continue;
+        candidates.emplace_back(BLOCK_SIZE - free, block);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    std::vector<uint16_t> evacuate;
+    size_t moving{0};
+    for (auto [live, block] : candidates) {
+        free_bytes -= BLOCK_SIZE - live;
+        if (moving + live > free_bytes) break;
+        moving += live;
+        evacuate.push_back(block);
+    }
+    if (evacuate.empty()) {
+        res.elapsed = std::chrono::steady_clock::now() - start;
+        return res;
+    }
+
+    // take the blocks out of the free index first, so nothing is moved
+    // into them
+    std::vector<Ref> movers;
+    std::vector<bool> evacuating(m_block_count, false);
+    for (uint16_t block : evacuate) {
+        evacuating[block] = true;
+        ForEachAllocated(block, [&](Ref ref) { movers.push_back(ref); });
+        BlockBitmap& bm = m_bitmaps[block];
+        for (uint16_t levels = bm.levels; levels != 0; levels &= levels - 1) {
+            size_t sh = std::countr_zero(levels);
+            for (size_t w = BlockBitmap::OFFSET[sh]; w < BlockBitmap::OFFSET[sh + 1]; ++w) {
+                m_free.count[sh] -= std::popcount(bm.bits[w]);
+            }
+            if (m_free.count[sh] == 0) m_free.levels &= ~(1u << sh);
+        }
+        bm = BlockBitmap{};
+    }
+
+    std::unordered_map<uint32_t, Ref> moved;
+    for (Ref r : movers) {
+        Shift16 sz{GetChunk(r)->taginfo().size};
+        Ref n = AllocateBuddy(sz);
+        std::copy_n(GetChunk(r), sz.chunk_size(), GetChunk(n));
+        moved.emplace(r.index, n);
+        ++res.moved_chunks;
+        res.moved_bytes += sz.byte_size();
+    }
+
+    auto forward = [&](Ref r) -> Ref {
+        auto it = moved.find(r.index);
+        return it == moved.end() ? r : it->second;
+    };
+    for (uint16_t block = first_block; block < m_block_count; ++block) {
+        if ((block < evacuating.size() && evacuating[block]) || IsDecommitted(block)) continue;
+        ForEachAllocated(block, [&](Ref ref) {
+            dispatch(ref, util::Overloaded(
+                [&](TagView<Tag::CONS,16>& cons) {
+                    cons.left = ShortRef{forward(cons.left)};
+                    cons.right = ShortRef{forward(cons.right)};
+                },
+                [&](TagView<Tag::SLICE,32>& slice) {
+                    slice.parent = ShortRef{forward(slice.parent)};
+                    slice.self = ref;
+                },
+                [&](TagView<Tag::ROPE,16>& rope) {
+                    rope.left = ShortRef{forward(rope.left)};
+                    rope.right = ShortRef{forward(rope.right)};
+                },
+                [&]<FuncyTagView FTV>(FTV& func) {
+                    func.env = ShortRef{forward(func.env)};
+                    if constexpr (requires { ShortRef{func.state}; }) {
+                        func.state = ShortRef{forward(func.state)};
+                    }
+                    if constexpr (requires { func.args; }) {
+                        for (size_t i = 0; i < func.counter; ++i) func.args[i] = ShortRef{forward(func.args[i])};
+                    }
+                },
+                [](auto&) { }
+            ));
+        });
+    }
+    for (Ref* root : roots) *root = forward(*root);
+    // conses are keyed on their children's refs, so any whose children
+    // moved are re-keyed once every stale key has been erased
+    std::vector<std::pair<uint64_t, Ref>> rekey;
+    for (auto it = m_intern.begin(); it != m_intern.end(); ) {
+        Ref n = forward(it->second);
+        if (!(n == it->second)) {
+            m_interned[it->second.index] = false;
+            it->second = n;
+            if (m_interned.size() <= n.index) m_interned.resize(m_block_count * CHUNK_COUNT);
+            m_interned[n.index] = true;
+        }
+        uint64_t hash{it->first};
+        dispatch(n, util::Overloaded(
+            [&](const TagView<Tag::CONS,16>& cons) { hash = ConsHash(cons.left, cons.right); },
+            [](const auto&) { }
+        ));
+        if (hash == it->first) {
+            ++it;
+        } else {
+            rekey.emplace_back(hash, n);
+            it = m_intern.erase(it);
+        }
+    }
+    for (const auto& [hash, ref] : rekey) {
+        // lost a hash collision: no longer the canonical copy
+        if (!m_intern.emplace(hash, ref).second) m_interned[ref.index] = false;
+    }
+
+    for (uint16_t block : evacuate) {
+        SetFree(m_free, Ref{{.block = block, .chunk = 0}}, BLOCK_EXP);
+    }
+    res.blocks_emptied = evacuate.size();
+    res.blocks_released = Trim(m_retain_empty);
+    res.elapsed = std::chrono::steady_clock::now() - start;
+    return res;
+}
+
+namespace {
+// minimal little-endian sign-magnitude encoding, as read by SmallInt
+std::span<const uint8_t> EncodeInt(int64_t n, std::array<uint8_t,9>& v)
+{
+    v.fill(0);
+    if (n == 0) return {};
     if (n == std::numeric_limits<int64_t>::min()) {
         v.back() = 0x80;
-        return create(v);
+        return v;
     }
     bool neg = n < 0;
     if (neg) n = -n;
@@ -214,7 +1158,172 @@ Ref Allocator::create(int64_t n)
     }
     if (v[i] & 0x80) ++i;
     if (neg) v[i] |= 0x80;
-    return create(std::span(v).subspan(0,i+1));
+    return std::span(v).subspan(0,i+1);
+}
+} // namespace
+
+Ref Allocator::create(int64_t n)
+{
+    if (Ref::fits_immediate(n)) return Ref::from_immediate(n);
+    std::array<uint8_t,9> v;
+    return create(EncodeInt(n, v));
+}
+
+size_t Allocator::IntAtomBytes(int64_t n)
+{
+    if (Ref::fits_immediate(n)) return 0;
+    std::array<uint8_t,9> v;
+    return EncodeInt(n, v).size();
+}
+
+std::pair<Ref, std::span<uint8_t>> Allocator::create_large(size_t size)
+{
+    using LargeView = TagView<Tag::LARGE_ATOM,16>;
+    assert(size <= MAX_LARGE_ATOM);
+    Shift16 sz{TagInfo::LARGE_MIN};
+    while (sz.byte_size() < LargeView::HEADER_SIZE + size) ++sz;
+    Ref ref{allocate(AllocShift16::FromInt(sz.sh))};
+    Chunk* chunk = GetChunk(ref);
+    LargeView& large = *TagViewAt<Tag::LARGE_ATOM,16>(chunk);
+    large.refcount.write(1);
+    large.size = size;
+    chunk->data[0] = TagInfo::Allocated(Tag::LARGE_ATOM, sz).tagbyte();
+    CountLive(chunk->taginfo(), true);
+    return {ref, large.span()};
+}
+
+Ref Allocator::create_slice(Ref parent, uint32_t offset, uint32_t size)
+{
+    Flatten(parent);
+    std::span<const uint8_t> sp;
+    Ref shared{NULLREF}; // the atom whose data a slice would point into
+    uint32_t shared_offset{0};
+    dispatch(parent, util::Overloaded(
+        [&](const TagView<Tag::LARGE_ATOM,16>& atv) { sp = atv.span(); shared = parent; },
+        [&](const TagView<Tag::OWNED_ATOM,16>& atv) { sp = atv.span(); shared = parent; },
+        [&](const TagView<Tag::EXT_ATOM,16>& atv) { sp = atv.span(); shared = parent; },
+        [&](const TagView<Tag::SLICE,32>& slice) {
+            // never chain slices, point at the original atom instead
+            sp = slice.span();
+            shared = slice.parent;
+            shared_offset = slice.offset;
+        },
+        [&]<AtomicTagView ATV>(const ATV& atv) { sp = atv.span(); },
+        [](const auto&) { }
+    ));
+    assert(offset <= sp.size() && size <= sp.size() - offset);
+
+    if (offset == 0 && size == sp.size()) return bumpref(parent);
+    // short results take no more room copied, and don't pin the parent;
+    // interning wants every atom in the table
+    if (shared.is_null() || size < 28 || (m_interning && !m_region_open)) return create(sp.subspan(offset, size));
+
+    m_stats.atom_bytes += size;
+    Ref ref = create<Tag::SLICE,32>({.offset=shared_offset + offset, .size=size, .parent=bumpref(shared), .self=NULLREF});
+    TagViewAt<Tag::SLICE,32>(GetChunk(ref))->self = ref;
+    return ref;
+}
+
+Ref Allocator::create_concat(Ref left, Ref right)
+{
+    const size_t left_size{*AtomSize(left)}, right_size{*AtomSize(right)};
+    if (right_size == 0) return bumpref(left);
+    if (left_size == 0) return bumpref(right);
+    // ropes can share subtrees, so sizes can double with each concatenation
+    if (left_size > MAX_ATOM_SIZE - right_size) return create_error();
+    const size_t size{left_size + right_size};
+    // interning wants every atom in the table
+    if (size > 123 && !(m_interning && !m_region_open)) {
+        m_stats.atom_bytes += size;
+        return create<Tag::ROPE,16>({.size=static_cast<uint32_t>(size), .left=bumpref(left), .right=bumpref(right)});
+    }
+
+    std::array<uint8_t, 123> arr;
+    std::vector<uint8_t> vec;
+    std::span<uint8_t> dst{arr};
+    if (size > arr.size()) {
+        vec.resize(size);
+        dst = vec;
+    }
+    auto it = dst.begin();
+    auto copy = [&](std::span<const uint8_t> sp) { it = std::copy(sp.begin(), sp.end(), it); };
+    ForEachPiece(left, copy);
+    ForEachPiece(right, copy);
+    return create(dst.subspan(0, size));
+}
+
+void Allocator::FlattenRope(Ref ref)
+{
+    Chunk* chunk = GetChunk(ref);
+    const auto& rope = *TagViewAt<Tag::ROPE,16>(chunk);
+    const uint32_t size{rope.size};
+    Ref left{rope.left}, right{rope.right};
+
+    uint8_t* data{static_cast<uint8_t*>(std::malloc(size))};
+    if (data == nullptr) throw std::bad_alloc();
+    uint8_t* it{data};
+    ForEachPiece(ref, [&](std::span<const uint8_t> sp) { it = std::copy(sp.begin(), sp.end(), it); });
+
+    // keep the header, and with it the refcount
+    CountLive(chunk->taginfo(), false);
+    auto& atomown = *TagViewAt<Tag::OWNED_ATOM,16>(chunk);
+    atomown.size = size;
+    atomown.data = data;
+    chunk->data[0] = TagInfo::Allocated(Tag::OWNED_ATOM, 16).tagbyte();
+    CountLive(chunk->taginfo(), true);
+    m_stats.malloc_bytes += size;
+
+    deref(std::move(left));
+    deref(std::move(right));
+}
+
+void Allocator::SetImmediate(Chunk* chunk, int64_t n)
+{
+    std::array<uint8_t,9> v;
+    *TagViewAt<Tag::INPLACE_ATOM,16>(chunk) = TagView<Tag::INPLACE_ATOM,16>{EncodeInt(n, v)};
+    chunk->data[0] = TagInfo::Allocated(Tag::INPLACE_ATOM, 16).tagbyte();
+}
+
+size_t Allocator::Stats::live_chunks() const
+{
+    size_t n{0};
+    for (const auto& by_size : live) {
+        for (size_t c : by_size) n += c;
+    }
+    return n;
+}
+
+size_t Allocator::Stats::free_bytes() const
+{
+    size_t n{0};
+    for (size_t sh = 0; sh < free.size(); ++sh) {
+        n += free[sh] * Shift16::FromInt(sh).byte_size();
+    }
+    return n;
+}
+
+double Allocator::Stats::fragmentation() const
+{
+    size_t total = free_bytes();
+    for (size_t sh = free.size(); sh > 0; --sh) {
+        if (free[sh-1] > 0) {
+            return 1.0 - static_cast<double>(free[sh-1] * Shift16::FromInt(sh-1).byte_size()) / total;
+        }
+    }
+    return 0.0;
+}
+
+std::string to_string(const Allocator::Stats& stats)
+{
+    std::string res = strprintf("blocks=%d high_water=%d live=%d free_bytes=%d fragmentation=%.3f malloc_bytes=%d allocations=%d atom_bytes=%d",
+        stats.blocks, stats.high_water, stats.live_chunks(), stats.free_bytes(), stats.fragmentation(), stats.malloc_bytes, stats.allocations, stats.atom_bytes);
+    for (size_t tag = 0; tag < stats.live.size(); ++tag) {
+        for (size_t sh = 0; sh < stats.live[tag].size(); ++sh) {
+            if (stats.live[tag][sh] == 0) continue;
+            res += strprintf(" tag%d/%d=%d", tag, Shift16::FromInt(sh).byte_size(), stats.live[tag][sh]);
+        }
+    }
+    return res;
 }
 
 std::string to_string(Allocator& alloc, Ref ref, bool in_list)
@@ -227,6 +1336,7 @@ std::string to_string(Allocator& alloc, Ref ref, bool in_list)
     if (ref.is_null()) {
         res = "NULLREF";
     } else {
+        alloc.Flatten(ref);
         alloc.dispatch(ref, util::Overloaded(
             [&]<size_t SIZE>(const TagView<Tag::NOREFCOUNT,SIZE>&) {
                 res = strprintf("NOREF(%d:-)", SIZE);
@@ -260,8 +1370,14 @@ std::string to_string(Allocator& alloc, Ref ref, bool in_list)
                 res = strprintf("ERROR(%s:%d)", err.filename, err.line);
             },
             [&](const TagView<Tag::FUNC,16>& func) { res = strprintf("FUNC(%s,state=%s,<env>)", get_funcname(func.funcid), to_string(alloc, func.state)); },
-            [&](const TagView<Tag::FUNC_COUNT,16>& func) { res = strprintf("FUNCC(%s,%d,state=%s,<env>)", get_funcname(func.funcid), func.counter, to_string(alloc, func.state)); },
-            [&](const TagView<Tag::FUNC_EXT,16>& func) { res = strprintf("FUNCEXT(%s,-,<env>)", get_funcname(func.funcid)); }
+            [&](const TagView<Tag::FUNC_COUNT,32>& func) {
+                std::string args;
+                for (size_t i = 0; i < func.counter; ++i) args += strprintf(",%s", to_string(alloc, func.args[i]));
+                res = strprintf("FUNCC(%s,%d%s,<env>)", get_funcname(func.funcid), func.counter, args);
+            },
+            [&](const TagView<Tag::FUNC_EXT,16>& func) { res = strprintf("FUNCEXT(%s,-,<env>)", get_funcname(func.funcid)); },
+            [&](const TagView<Tag::FUNC_NUM,16>& func) { res = strprintf("FUNCN(%s,state=%d,<env>)", get_funcname(func.funcid), func.num()); },
+            [&](const TagView<Tag::ROPE,16>&) { } // flattened above
         ));
     }
     if (in_list) {
@@ -6,7 +6,11 @@
 #include <overloaded.h>
 #include <tinyformat.h>
 
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <cassert>
+#include <chrono>
 #include <cstdint>
 #include <cstdlib>
 #include <iostream>
@@ -15,15 +19,33 @@
 #include <optional>
 #include <source_location>
 #include <span>
+#include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 namespace Buddy {
 
+// Refs inside chunks are packed into REF_BYTES. Wide refs lift the heap
+// limit from 256MiB to 32GiB, at the cost of bigger blocks and bitmaps.
+#ifdef BLL_WIDE_REFS
+static constexpr size_t REF_BYTES{4};
+static constexpr size_t BLOCK_SIZE{512*1024};
+#else
+static constexpr size_t REF_BYTES{3};
 static constexpr size_t BLOCK_SIZE{256*1024};
+#endif
 static constexpr uint16_t CHUNK_COUNT{BLOCK_SIZE / 16};
 
 static_assert(((BLOCK_SIZE-1) & BLOCK_SIZE) == 0, "must be power of 2");
 
+// How block memory is obtained from the OS
+enum class HugePages : uint8_t {
+    NONE,        // plain anonymous mmap
+    TRANSPARENT, // madvise(MADV_HUGEPAGE) each extent
+    EXPLICIT,    // MAP_HUGETLB, falling back to TRANSPARENT if no huge pages are available
+};
+
 // Default initialize an array, with explicit initializer
 template<typename T, std::size_t N>
 constexpr static inline std::array<T, N> make_filled_array(const T& def)
@@ -73,7 +95,7 @@ struct Shift16
         return Shift16::FromInt(s16.sh - x);
     }
 
-    Shift16& set(uint8_t _sh) { sh = _sh; return *this; }
+    constexpr Shift16& set(uint8_t _sh) { sh = _sh; return *this; }
     constexpr size_t byte_size() const { return 16 << sh; }
     constexpr size_t chunk_size() const { return 1 << sh; }
 };
@@ -82,7 +104,15 @@ struct AllocShift16 : public Shift16
 {
     consteval AllocShift16(size_t n) : Shift16{n}
     {
-        if (n > 128) throw;
+        if (n > BLOCK_SIZE) throw;
+    }
+
+    static AllocShift16 FromInt(uint8_t sh)
+    {
+        assert(sh <= AllocShift16{BLOCK_SIZE}.sh);
+        AllocShift16 r{16};
+        r.set(sh);
+        return r;
     }
 };
 
@@ -97,10 +127,18 @@ enum class Tag : uint8_t
     FUNC         = 6,
     FUNC_COUNT   = 7,
     FUNC_EXT     = 8,
+    LARGE_ATOM   = 9,
+    SLICE        = 10,
+    ROPE         = 11,
+    FUNC_NUM     = 12,
 };
 
-inline std::optional<Tag> GetTag(uint8_t t, Shift16 sz)
+constexpr std::optional<Tag> GetTag(uint8_t t, Shift16 sz)
 {
+    if (t == static_cast<uint8_t>(Tag::SLICE)) return sz.sh == 1 ? std::optional{Tag::SLICE} : std::nullopt;
+    if (t == static_cast<uint8_t>(Tag::ROPE)) return sz.sh == 0 ? std::optional{Tag::ROPE} : std::nullopt;
+    if (t == static_cast<uint8_t>(Tag::FUNC_NUM)) return sz.sh == 0 ? std::optional{Tag::FUNC_NUM} : std::nullopt;
+    if (t == static_cast<uint8_t>(Tag::FUNC_COUNT)) return sz.sh == 1 ? std::optional{Tag::FUNC_COUNT} : std::nullopt;
     if (t > static_cast<uint8_t>(Tag::FUNC_EXT)) return std::nullopt;
     if (sz.sh > 0 && t > static_cast<uint8_t>(Tag::INPLACE_ATOM)) return std::nullopt;
     return Tag{t};
@@ -111,6 +149,11 @@ struct TagInfo {
     Shift16 size{16};
     std::optional<Tag> tag{std::nullopt};
 
+    // LARGE_ATOM chunks are 256 bytes up to a whole block, too big for the
+    // two size bits other tags get, so their tag byte is 0x40 | Shift16
+    static constexpr uint8_t LARGE_BIT{0x40};
+    static constexpr Shift16 LARGE_MIN{256};
+
     TagInfo() = default;
     constexpr TagInfo(uint8_t b)
     {
@@ -118,6 +161,10 @@ struct TagInfo {
             free = true;
             size.set(b & 0x7F);
             tag = std::nullopt;
+        } else if ((b & LARGE_BIT) != 0) {
+            free = false;
+            size.set(b & ~LARGE_BIT);
+            if (size.sh >= LARGE_MIN.sh) tag = Tag::LARGE_ATOM;
         } else {
             free = false;
             size.set(b & 0x03);
@@ -127,6 +174,7 @@ struct TagInfo {
 
     constexpr uint8_t tagbyte() const
     {
+        if (!free && tag == Tag::LARGE_ATOM) return LARGE_BIT | size.sh;
         return (free ? 0x80 : 0x00) | (static_cast<uint8_t>(tag.value_or(Tag::NOREFCOUNT)) << 2) | size.sh;
     }
 
@@ -147,42 +195,79 @@ struct TagInfo {
     }
 };
 
-class Uint24
+// Little-endian unsigned integer of N unaligned bytes
+template<size_t N>
+class UintN
 {
+public:
+    using value_type = std::conditional_t<(N <= 4), uint32_t, uint64_t>;
+
 private:
-    std::array<uint8_t, 3> val{0,0,0};
+    std::array<uint8_t, N> val{};
 
-    static constexpr uint8_t by(uint32_t v, size_t n) { return static_cast<uint8_t>((v >> (8*n)) & 0xFF); }
+    static constexpr uint8_t by(value_type v, size_t n) { return static_cast<uint8_t>((v >> (8*n)) & 0xFF); }
 public:
-    Uint24() = default;
-    explicit constexpr Uint24(std::span<const uint8_t> s)
+    UintN() = default;
+    explicit constexpr UintN(std::span<const uint8_t> s)
     {
-        if (s.size() == 3) {
-            val[0] = s[0]; val[1] = s[1]; val[2] = s[2];
-        }
+        if (s.size() == N) std::copy(s.begin(), s.end(), val.begin());
     }
-    constexpr Uint24(uint32_t v) : val{by(v,0), by(v,1), by(v,2)} { }
+    constexpr UintN(value_type v) { write(v); }
 
-    constexpr uint32_t read() const { return val[0] + (val[1] << 8) + (val[2] << 16); }
+    constexpr value_type read() const
+    {
+        value_type v{0};
+        for (size_t n = 0; n < N; ++n) v |= value_type{val[n]} << (8*n);
+        return v;
+    }
 
-    void write(uint32_t v)
+    constexpr void write(value_type v)
     {
-        val[0] = by(v,0);
-        val[1] = by(v,1);
-        val[2] = by(v,2);
+        for (size_t n = 0; n < N; ++n) val[n] = by(v, n);
     }
 };
+using Uint24 = UintN<3>;
 static_assert(sizeof(Uint24) == 3 && alignof(Uint24) == 1);
 static_assert(Uint24{uint32_t{1000}}.read() == 1000);
 
+// A pointer in 7 unaligned bytes; user space addresses fit in 56 bits
+class PackedPtr
+{
+private:
+    UintN<7> m_value;
+
+public:
+    PackedPtr(const void* p = nullptr) : m_value{reinterpret_cast<uintptr_t>(p)} { }
+    operator const void*() const { return reinterpret_cast<const void*>(m_value.read()); }
+};
+static_assert(sizeof(PackedPtr) == 7 && alignof(PackedPtr) == 1);
+
 class Ref
 {
 private:
     friend class Allocator;
     friend class ShortRef;
 
-    uint16_t block;
-    uint16_t chunk;
+    // chunk offset from the start of the allocator's address space; the
+    // last chunk is never allocated, so its index doubles as null
+    static constexpr uint32_t NULL_INDEX{static_cast<uint32_t>((uint64_t{1} << (8 * REF_BYTES)) - 1)};
+    // the 2^21 indices below that encode small integers directly; no
+    // chunk is ever allocated for them
+    static constexpr int64_t IMMEDIATE_MIN{-(int64_t{1} << 20)};
+    static constexpr int64_t IMMEDIATE_MAX{(int64_t{1} << 20) - 1};
+    static constexpr uint32_t IMMEDIATE_BASE{NULL_INDEX - (uint32_t{1} << 21)};
+    uint32_t index;
+
+    static constexpr bool fits_immediate(int64_t n) { return IMMEDIATE_MIN <= n && n <= IMMEDIATE_MAX; }
+    static constexpr Ref from_immediate(int64_t n)
+    {
+        Ref r{NullRef_tag{}};
+        r.index = IMMEDIATE_BASE + static_cast<uint32_t>(n - IMMEDIATE_MIN);
+        return r;
+    }
+
+    constexpr uint16_t block() const { return static_cast<uint16_t>(index / CHUNK_COUNT); }
+    constexpr uint16_t chunk() const { return static_cast<uint16_t>(index % CHUNK_COUNT); }
 
 public:
     struct NullRef_tag { };
@@ -191,22 +276,28 @@ public:
 
     struct Bare { uint16_t block, chunk; };
 
-    constexpr Ref(const NullRef_tag&) : block{0xFFFF}, chunk{0xFFFF} { }
-    explicit constexpr Ref(Bare b) : block{b.block}, chunk{b.chunk} { }
+    constexpr Ref(const NullRef_tag&) : index{NULL_INDEX} { }
+    explicit constexpr Ref(Bare b) : index{uint32_t{b.block} * CHUNK_COUNT + b.chunk} { }
 
     constexpr Ref(const Ref&) = default;
     Ref& operator=(Ref&& o) = default;
     constexpr Ref(Ref&& other) = default;
     Ref& operator=(const Ref&) = default;
 
-    void set_null() { block = chunk = 0xFFFF; }
-    constexpr bool is_null() const { return block == 0xFFFF && chunk == 0xFFFF; }
+    void set_null() { index = NULL_INDEX; }
+    constexpr bool is_null() const { return index == NULL_INDEX; }
+    constexpr bool is_immediate() const { return index >= IMMEDIATE_BASE && index != NULL_INDEX; }
+    constexpr std::optional<int64_t> immediate() const
+    {
+        if (!is_immediate()) return std::nullopt;
+        return int64_t{index - IMMEDIATE_BASE} + IMMEDIATE_MIN;
+    }
 
     Ref take() { Ref r = *this; set_null(); return r; }
 
     friend constexpr bool operator==(const Ref& l, const Ref& r)
     {
-        return l.block == r.block && l.chunk == r.chunk;
+        return l.index == r.index;
     }
 };
 inline constexpr Ref::NullRef_tag NULLREF{};
@@ -214,30 +305,26 @@ inline constexpr Ref::NullRef_tag NULLREF{};
 class ShortRef
 {
 private:
-    Uint24 m_value;
+    UintN<REF_BYTES> m_value;
 
-    static_assert( (1ul<<24)/CHUNK_COUNT <= std::numeric_limits<uint16_t>::max() );
     static_assert( CHUNK_COUNT <= std::numeric_limits<uint16_t>::max() );
 
 public:
-    constexpr ShortRef(const Ref& ref) : m_value{static_cast<uint32_t>(ref.is_null() ? 0xFFFFFF : ref.block * CHUNK_COUNT + ref.chunk)} { }
+    constexpr ShortRef(const Ref& ref) : m_value{ref.index} { }
     constexpr ShortRef(const Ref::NullRef_tag&) : ShortRef(Ref(NULLREF)) { }
 
     constexpr operator Ref() const
     {
-        Ref::Bare res{.block=0xFFFF, .chunk=0xFFFF};
-        uint32_t v = m_value.read();
-        if (v != 0xFFFFFF) {
-            res.block = static_cast<uint16_t>(v / CHUNK_COUNT);
-            res.chunk = static_cast<uint16_t>(v % CHUNK_COUNT);
-        }
-        return Ref{res};
+        Ref res{NULLREF};
+        res.index = m_value.read();
+        return res;
     }
 
     constexpr uint32_t get_value() const { return m_value.read(); }
 };
 static_assert(Ref{ShortRef{NULLREF}} == Ref{NULLREF});
-static_assert(ShortRef{NULLREF}.get_value() == 0xFFFFFF);
+static_assert(ShortRef{NULLREF}.get_value() == (uint64_t{1} << (8 * REF_BYTES)) - 1);
+static_assert(sizeof(ShortRef) == REF_BYTES);
 
 enum class Func : uint16_t;
 enum class FuncCount : uint16_t;
@@ -304,12 +391,63 @@ struct TagView<Tag::EXT_ATOM, 16> : public TagRefCount
 };
 static_assert(sizeof(TagView<Tag::EXT_ATOM, 16>) == 16);
 
+// The header of an atom stored inline in a chunk of 256 bytes or more; its
+// data runs on to the end of the chunk, whose size is in the tag byte
+template<>
+struct alignas(16) TagView<Tag::LARGE_ATOM, 16> : public TagRefCount
+{
+    static constexpr size_t HEADER_SIZE{8};
+
+    uint32_t size;
+    std::array<uint8_t, 16 - HEADER_SIZE> data;
+    std::span<uint8_t> span() { return std::span<uint8_t>{data.data(), size}; }
+    std::span<const uint8_t> span() const { return std::span<const uint8_t>{data.data(), size}; }
+};
+static_assert(sizeof(TagView<Tag::LARGE_ATOM, 16>) == 16);
+
+// A substring of a LARGE, OWNED or EXT atom, holding a reference to it.
+// The slice records its own ref so it can find the parent chunk relative
+// to itself wherever the heap is mapped; whatever moves a slice updates it
+template<>
+struct alignas(16) TagView<Tag::SLICE, 32> : public TagRefCount
+{
+    uint32_t offset; // into the parent's data
+    uint32_t size;
+    ShortRef parent;
+    ShortRef self;
+    std::array<uint8_t, 20 - 2 * REF_BYTES> unused{};
+    std::span<const uint8_t> span() const
+    {
+        const auto* chunk = reinterpret_cast<const uint8_t*>(this) + 16 * (int64_t{parent.get_value()} - int64_t{self.get_value()});
+        std::span<const uint8_t> sp;
+        switch (*TagInfo{chunk[0]}.tag) {
+        case Tag::LARGE_ATOM: sp = reinterpret_cast<const TagView<Tag::LARGE_ATOM, 16>*>(chunk)->span(); break;
+        case Tag::OWNED_ATOM: sp = reinterpret_cast<const TagView<Tag::OWNED_ATOM, 16>*>(chunk)->span(); break;
+        default: sp = reinterpret_cast<const TagView<Tag::EXT_ATOM, 16>*>(chunk)->span(); break;
+        }
+        return sp.subspan(offset, size);
+    }
+};
+static_assert(sizeof(TagView<Tag::SLICE, 32>) == 32);
+
+// Two atoms end to end, either of which may be a rope itself, so OP_CAT
+// needn't copy. It is not an AtomicTagView: anything wanting a contiguous
+// span flattens it first, turning the chunk into an OWNED_ATOM in place
+template<>
+struct TagView<Tag::ROPE, 16> : public TagRefCount
+{
+    uint32_t size;
+    ShortRef left;
+    ShortRef right;
+};
+static_assert(sizeof(TagView<Tag::ROPE, 16>) == 16);
+
 template<>
 struct TagView<Tag::CONS, 16> : public TagRefCount
 {
     ShortRef left;
     ShortRef right;
-    std::array<uint8_t,6> padding{0};
+    std::array<uint8_t, 12 - 2 * REF_BYTES> padding{0};
 };
 static_assert(sizeof(TagView<Tag::CONS, 16>) == 16);
 
@@ -329,21 +467,25 @@ struct TagView<Tag::FUNC, 16> : public TagRefCount
     FuncEnumType funcid;
     ShortRef env;
     ShortRef state;
-    std::array<uint8_t, 4> extra_state{0,0,0,0};
+    std::array<uint8_t, 10 - 2 * REF_BYTES> extra_state{};
 };
 static_assert(sizeof(TagView<Tag::FUNC, 16>) == 16);
 
+// The arguments a FuncCount has been given so far, in order, in slots
+// filled as each is evaluated. No FuncCount opcode takes more than ARGS
 template<>
-struct TagView<Tag::FUNC_COUNT, 16> : public TagRefCount
+struct TagView<Tag::FUNC_COUNT, 32> : public TagRefCount
 {
     using FuncEnumType = FuncCount;
+    static constexpr size_t ARGS{3};
 
     FuncEnumType funcid;
     ShortRef env;
-    ShortRef state;
-    uint32_t counter{0};
+    uint8_t counter{0};
+    std::array<ShortRef, ARGS> args{NULLREF, NULLREF, NULLREF};
+    std::array<uint8_t, 25 - 4 * REF_BYTES> unused{};
 };
-static_assert(sizeof(TagView<Tag::FUNC_COUNT, 16>) == 16);
+static_assert(sizeof(TagView<Tag::FUNC_COUNT, 32>) == 32);
 
 template<>
 struct TagView<Tag::FUNC_EXT, 16> : public TagRefCount
@@ -352,10 +494,30 @@ struct TagView<Tag::FUNC_EXT, 16> : public TagRefCount
 
     FuncEnumType funcid;
     ShortRef env;
-    const void* state{nullptr};
+    std::conditional_t<REF_BYTES == 3, const void*, PackedPtr> state{nullptr};
 };
 static_assert(sizeof(TagView<Tag::FUNC_EXT, 16>) == 16);
 
+// A FUNC whose state is a number, kept unboxed rather than as an atom.
+// Totals too big for the bytes left once the env is packed in stay boxed
+// in a plain FUNC
+template<>
+struct TagView<Tag::FUNC_NUM, 16> : public TagRefCount
+{
+    using FuncEnumType = Func;
+
+    FuncEnumType funcid;
+    ShortRef env;
+    UintN<10 - REF_BYTES> num_bytes{}; // two's complement
+
+    static constexpr int BITS{8 * (10 - REF_BYTES)};
+    static constexpr bool fits(int64_t n) { return -(int64_t{1} << (BITS-1)) <= n && n < (int64_t{1} << (BITS-1)); }
+
+    int64_t num() const { return static_cast<int64_t>(num_bytes.read() << (64 - BITS)) >> (64 - BITS); }
+    void set_num(int64_t n) { assert(fits(n)); num_bytes.write(static_cast<uint64_t>(n)); }
+};
+static_assert(sizeof(TagView<Tag::FUNC_NUM, 16>) == 16);
+
 template<typename Fn>
 concept TagViewCallable =
     std::invocable<Fn, TagView<Tag::NOREFCOUNT, 16>&> &&
@@ -371,8 +533,12 @@ concept TagViewCallable =
     std::invocable<Fn, TagView<Tag::CONS, 16>&> &&
     std::invocable<Fn, TagView<Tag::ERROR, 16>&> &&
     std::invocable<Fn, TagView<Tag::FUNC, 16>&> &&
-    std::invocable<Fn, TagView<Tag::FUNC_COUNT, 16>&> &&
-    std::invocable<Fn, TagView<Tag::FUNC_EXT, 16>&>;
+    std::invocable<Fn, TagView<Tag::FUNC_COUNT, 32>&> &&
+    std::invocable<Fn, TagView<Tag::FUNC_EXT, 16>&> &&
+    std::invocable<Fn, TagView<Tag::FUNC_NUM, 16>&> &&
+    std::invocable<Fn, TagView<Tag::LARGE_ATOM, 16>&> &&
+    std::invocable<Fn, TagView<Tag::SLICE, 32>&> &&
+    std::invocable<Fn, TagView<Tag::ROPE, 16>&>;
 
 template<typename TV>
 inline constexpr bool IsTagView = false;
@@ -390,6 +556,7 @@ template<typename T>
 concept FuncyTagView = IsTagView<T> && FuncEnum<typename T::FuncEnumType> &&
     std::same_as<typename T::FuncEnumType, decltype(T::funcid)>;
 static_assert(FuncyTagView<TagView<Tag::FUNC,16>>);
+static_assert(FuncyTagView<TagView<Tag::FUNC_NUM,16>>);
 
 template<typename T>
 struct quoted_type {
@@ -402,26 +569,55 @@ quoted_type(T&&) -> quoted_type<std::decay_t<T>>;
 
 inline constexpr auto quote = [](auto&& v) -> quoted_type<std::decay_t<decltype(v)>> { return quoted_type<std::decay_t<decltype(v)>>{std::forward<decltype(v)>(v)}; };
 
+template<bool RequireMin=true>
+inline std::optional<int64_t> SmallInt(std::span<const uint8_t> sp)
+{
+    if (sp.empty()) return 0;
+    if constexpr (RequireMin) {
+        if (sp.back() == 0x00 || sp.back() == 0x80) {
+            size_t s = sp.size();
+            if (s == 1 || (sp[s-2] & 0x80) == 0) return std::nullopt;
+        }
+    }
+    int64_t res = 0;
+    if (sp.back() & 0x80) {
+        // negative
+        for (size_t i = 0; i < sp.size(); ++i) {
+            int64_t v = sp[i];
+            if (i == sp.size() - 1) v &= 0x7F;
+            if (sp[i] != 0) {
+                 if (i >= 8) return std::nullopt;
+                 if (i == 7 && ((res > 0 && v == 0x80) || v > 0x80)) return std::nullopt;
+                 res += (-v << (8*i));
+            }
+        }
+    } else {
+        // positive
+        for (size_t i = 0; i < sp.size(); ++i) {
+            int64_t v = sp[i];
+            if (sp[i] != 0) {
+                 if (i >= 8) return std::nullopt;
+                 if (i == 7 && v >= 0x80) return std::nullopt;
+                 res += (v << (8*i));
+            }
+        }
+    }
+    return res;
+}
+
+class Prelude;
+
 class Allocator
 {
 private:
-    struct Info {
-        uint8_t tag;
-        Ref prev;
-        Ref next;
-    };
-    static_assert(sizeof(Info) <= 16);
-    static_assert(alignof(Info) <= 16);
+    friend class Prelude;
 
     struct alignas(16) Chunk {
         std::array<uint8_t, 16> data;
 
-        Info& info() { return *reinterpret_cast<Info*>(&data); }
-
         constexpr TagInfo taginfo() const { return TagInfo{data[0]}; }
     };
     static_assert(sizeof(Chunk) == 16);
-    static_assert(offsetof(Chunk, data) == offsetof(Info, tag));
 
     template<Tag TAG, size_t SIZE>
     TagView<TAG, SIZE>* TagViewAt(Chunk* chunk)
@@ -439,26 +635,209 @@ private:
     static_assert(CHUNK_COUNT * sizeof(Chunk) == BLOCK_SIZE);
     static_assert(sizeof(Block) == BLOCK_SIZE);
 
-    std::vector<std::unique_ptr<Block>> m_blocks;
+    // The whole range a ShortRef can address is reserved up front and
+    // committed lazily as pages are first touched, so a Ref is just a chunk
+    // offset from m_base. Blocks are handed out in order, and extents of
+    // blocks are aligned so each can be backed by a single 2MiB huge page.
+    // Blocks stop a whole extent short of the immediates and NULLREF; wide
+    // refs run out of block numbers first.
+    static constexpr size_t EXTENT_BLOCKS{8};
+    static constexpr size_t EXTENT_SIZE{EXTENT_BLOCKS * BLOCK_SIZE};
+    static constexpr size_t MAX_BLOCKS{std::min<size_t>(Ref::IMMEDIATE_BASE / (EXTENT_BLOCKS * CHUNK_COUNT) * EXTENT_BLOCKS, 1ul << 16)};
+    static constexpr size_t RESERVED_SIZE{MAX_BLOCKS * BLOCK_SIZE};
+    static constexpr size_t IMMEDIATES_SIZE{(Ref::NULL_INDEX - Ref::IMMEDIATE_BASE) * sizeof(Chunk)};
+    static_assert(MAX_BLOCKS % EXTENT_BLOCKS == 0);
+    static constexpr size_t LEVELS{BLOCK_EXP.sh + 1};
+
+    // Free space is tracked in bitmaps kept apart from the heap, so finding,
+    // splitting and merging free chunks never touches the chunks themselves.
+    // Bit i of level s is set when chunk i<<s of the block starts a free
+    // chunk of Shift16 s.
+    struct BlockBitmap
+    {
+        // start of each level's words in bits; levels 8 and up fit in one word
+        static constexpr std::array<size_t, LEVELS + 1> OFFSET{[]() {
+            std::array<size_t, LEVELS + 1> off{};
+            for (size_t sh = 0; sh < LEVELS; ++sh) {
+                off[sh + 1] = off[sh] + std::max<size_t>(1, (CHUNK_COUNT >> sh) / 64);
+            }
+            return off;
+        }()};
+        static constexpr size_t SUMMARY_WORDS{(OFFSET[1] + 63) / 64};
+
+        std::array<uint64_t, OFFSET[LEVELS]> bits{};
+        std::array<std::array<uint64_t, SUMMARY_WORDS>, LEVELS> summary{}; // bit w: bits word w of the level is non-zero
+        uint16_t levels{0}; // bit s: the block has a free chunk of Shift16 s
+    };
+    static_assert(LEVELS <= 16);
+
+    // Which blocks have free chunks of each size. Block bits are cleared
+    // lazily by FindFree, so a chunk size flipping between free and used
+    // within one block only touches that block's bitmap.
+    struct FreeIndex
+    {
+        static constexpr size_t BLOCK_WORDS{(MAX_BLOCKS + 63) / 64};
+        static constexpr size_t SUMMARY_WORDS{(BLOCK_WORDS + 63) / 64};
+
+        std::array<std::array<uint64_t, BLOCK_WORDS>, LEVELS> blocks{}; // bit b: block b may have a free chunk of Shift16 s
+        std::array<std::array<uint64_t, SUMMARY_WORDS>, LEVELS> summary{}; // bit w: blocks word w of the level is non-zero
+        std::array<size_t, LEVELS> count{}; // free chunks, by Shift16
+        std::array<Ref, LEVELS> recent{make_filled_array<Ref, LEVELS>(NULLREF)}; // last chunk freed, by Shift16; may be stale
+        uint16_t levels{0}; // bit s: count[s] is non-zero
+    };
+
+public:
+    // Counters are maintained as chunks are allocated and freed, so reading
+    // them costs nothing regardless of heap size
+    struct Stats
+    {
+        static constexpr size_t TAGS{static_cast<size_t>(Tag::FUNC_NUM) + 1};
+        static constexpr size_t SIZES{LEVELS}; // by Shift16, up to a whole block
+
+        std::array<std::array<size_t, SIZES>, TAGS> live{}; // live chunks, by Tag and size class
+        std::array<size_t, BLOCK_EXP.sh + 1> free{}; // free chunks outside any region, by Shift16
+        size_t blocks{0}; // committed blocks
+        size_t high_water{0}; // most blocks committed at once
+        size_t malloc_bytes{0}; // held outside the heap by OWNED_ATOM and FUNC_EXT
+        size_t allocations{0}; // chunks handed out, ever
+        size_t atom_bytes{0}; // bytes of atoms created, ever, however they're stored
+
+        size_t live_chunks() const;
+        size_t free_bytes() const;
+        // share of free bytes not in chunks of the largest free size
+        double fragmentation() const;
+    };
+
+private:
+    HugePages m_huge_pages;
+    Chunk* m_base;
+    std::shared_ptr<const Prelude> m_prelude;
+    uint32_t m_prelude_end{0}; // chunk index just past the prelude's blocks
+    size_t m_block_count{0}; // blocks handed out from the reservation
+    std::vector<bool> m_hugetlb; // by extent; explicit huge pages can't be partially decommitted
+    std::vector<BlockBitmap> m_bitmaps; // indexed by block
+    std::vector<uint16_t> m_decommitted; // empty blocks whose pages were handed back to the OS
+    std::vector<bool> m_decommitted_block; // indexed by block
+    std::span<const uint8_t> m_snapshot_data; // atom data mapped from a loaded snapshot
+    Chunk* m_immediates; // an INPLACE_ATOM per immediate, written on first dispatch
+
+    FreeIndex m_free;
+
+    size_t m_retain_empty{4}; // empty blocks kept committed before trimming
+
+    Stats m_stats;
+    std::array<size_t, FuncEnumSize<FuncExt>> m_func_ext_size{}; // malloc'd state size, by funcid
+
+    void CountLive(TagInfo t, bool live)
+    {
+        if (!t.tag) return;
+        size_t& n = m_stats.live[static_cast<size_t>(*t.tag)][t.size.sh];
+        if (live) ++n; else --n;
+    }
+
+    // While a region is open, all allocations come from blocks private to
+    // the region, which are handed back wholesale by EndRegion
+    bool m_region_open{false};
+    std::vector<bool> m_region_block; // indexed by block
+    std::vector<uint16_t> m_region_blocks;
+    FreeIndex m_region_free;
+
+    FreeIndex& IndexFor(uint16_t block) { return m_region_block[block] ? m_region_free : m_free; }
+
+    Chunk* GetChunk(Ref ref) { return m_base + ref.index; }
+    bool IsPrelude(Ref ref) const { return ref.index < m_prelude_end; }
+    // neither prelude chunks nor immediates are refcounted
+    bool IsStatic(Ref ref) const { return IsPrelude(ref) || ref.is_immediate(); }
+    static Ref FromIndex(uint32_t index) { Ref ref{NULLREF}; ref.index = index; return ref; }
+
+    Chunk* ImmediateChunk(Ref ref)
+    {
+        Chunk* chunk = m_immediates + (ref.index - Ref::IMMEDIATE_BASE);
+        if (chunk->data[0] == 0) [[unlikely]] SetImmediate(chunk, *ref.immediate());
+        return chunk;
+    }
+    void SetImmediate(Chunk* chunk, int64_t n);
+    void FlattenRope(Ref ref);
+
+    // by tag byte: whether the chunk starts with a TagRefCount
+    static constexpr std::array<bool, 256> REFCOUNTED{[]() {
+        std::array<bool, 256> res{};
+        for (size_t b = 0; b < res.size(); ++b) {
+            TagInfo tag{static_cast<uint8_t>(b)};
+            res[b] = !tag.free && tag.tag.has_value() && *tag.tag != Tag::NOREFCOUNT;
+        }
+        return res;
+    }()};
 
-    std::array<Ref, BLOCK_EXP.sh + 1> m_free{make_filled_array<Ref, BLOCK_EXP.sh + 1>(NULLREF)};
+    // ref must not be null, prelude or immediate
+    TagRefCount* RefCountAt(Ref ref)
+    {
+        Chunk* chunk = GetChunk(ref);
+        return REFCOUNTED[chunk->data[0]] ? reinterpret_cast<TagRefCount*>(chunk) : nullptr;
+    }
 
-    Chunk* GetChunk(Ref ref) { return &(m_blocks[ref.block]->chunk[ref.chunk]); }
+    // the tag byte of an allocated TagView<TAG,SIZE> chunk
+    template<Tag TAG, size_t SIZE>
+    static constexpr uint8_t TAGBYTE{TagInfo::Allocated(TAG, SIZE).tagbyte()};
 
-    /* Removes ref from free list, returns "next" if available or NULLREF */
-    Ref TakeFree(Ref ref);
     Ref GetBuddy(Ref ref, Shift16 sz)
     {
-        return Ref{{.block = ref.block, .chunk=static_cast<uint16_t>(ref.chunk ^ sz.chunk_size())}};
+        Ref buddy{ref};
+        buddy.index ^= sz.chunk_size();
+        return buddy;
     }
 
-    void MakeFree(Ref ref, Shift16 sz);
+    bool IsFree(Ref ref, Shift16 sz) const
+    {
+        size_t idx = ref.chunk() >> sz.sh;
+        return (m_bitmaps[ref.block()].bits[BlockBitmap::OFFSET[sz.sh] + idx / 64] >> (idx % 64)) & 1;
+    }
+    // size of the free chunk starting at ref, if there is one
+    std::optional<Shift16> FreeSizeAt(Ref ref) const;
+    // index must be IndexFor(ref.block())
+    void SetFree(FreeIndex& index, Ref ref, Shift16 sz);
+    void ClearFree(FreeIndex& index, Ref ref, Shift16 sz);
+    // a free chunk of exactly Shift16 sz, which must exist: the most recently
+    // freed if it is still free, otherwise the lowest addressed
+    Ref FindFree(FreeIndex& index, Shift16 sz);
+
+    // whole free block, reusing a decommitted one if possible
+    Ref NewBlock();
+    // prepares the next extent of the reservation for use
+    void CommitExtent(size_t extent);
+    void DecommitBlock(uint16_t block);
+    bool IsDecommitted(uint16_t block) const { return m_decommitted_block[block]; }
+
+    // Recently freed 16 byte chunks outside any region, reused LIFO ahead
+    // of the buddy system. Refilled by carving up one larger chunk, and
+    // flushed from the cold end when full. Cached chunks are tagged free
+    // but are allocated as far as the bitmaps are concerned, so anything
+    // walking the heap flushes first.
+    static constexpr size_t TCACHE_SIZE{64};
+    static constexpr Shift16 TCACHE_REFILL{512}; // 32 chunks
+    std::array<Ref, TCACHE_SIZE> m_tcache{make_filled_array<Ref, TCACHE_SIZE>(NULLREF)};
+    size_t m_tcache_count{0};
+
+    void RefillCache();
+    // returns the n oldest cached chunks to the buddy system
+    void FlushCache(size_t n=TCACHE_SIZE);
 
     // allocates, without tagging
-    Ref allocate(AllocShift16 sz);
+    Ref allocate(AllocShift16 sz)
+    {
+        ++m_stats.allocations;
+        if (sz.sh == 0 && !m_region_open) {
+            if (m_tcache_count == 0) RefillCache();
+            return m_tcache[--m_tcache_count];
+        }
+        return AllocateBuddy(sz);
+    }
+    Ref AllocateBuddy(Shift16 sz);
     // combines buddies; but does not recursively deref
     void deallocate(Ref&& ref);
+    void ReleaseBuddy(Ref r, Shift16 sz);
 
+    // tags ref, without updating stats
     template<Tag TAG, size_t SIZE>
     void set_at(Ref ref, TagView<TAG, SIZE> tv)
     {
@@ -467,46 +846,278 @@ private:
         chunk->data[0] = TagInfo::Allocated(TAG, SIZE).tagbyte();
     }
 
-    std::array<Ref,2> _nilone = {NULLREF, NULLREF};
-
+    // dead chunks still to be freed while freeing is deferred; the same
+    // work/todo pair FreeChain uses
+    bool m_deferred_free{false};
+    Ref m_pending_work{NULLREF};
+    Ref m_pending_todo{NULLREF};
+
+    // drops one reference and returns true if r has others, otherwise
+    // leaves it for the caller to free
+    bool DropShared(Ref r);
+    // frees work and everything it solely owns, then the chunks queued on
+    // todo, until budget chunks have been freed; returns chunks freed
+    size_t FreeChain(Ref& work, Ref& todo, size_t budget);
     void _deref(Ref&& ref);
 
+    // Values are hash-consed while interning is on: the table maps a content
+    // hash to the one chunk holding that value, and m_interned marks those
+    // chunks so they can be dropped from the table when they die. Hash
+    // collisions just leave the newer value uninterned.
+    bool m_interning{false};
+    std::unordered_map<uint64_t, Ref> m_intern;
+    std::vector<bool> m_interned; // indexed by Ref index
+
+    bool IsInterned(Ref ref) const { return ref.index < m_interned.size() && m_interned[ref.index]; }
+    Ref Intern(std::span<const uint8_t> sp);
+    Ref InternCons(Ref&& left, Ref&& right);
+    void AddInterned(uint64_t hash, Ref ref);
+    // removes ref from the table; called as soon as it dies, while its
+    // contents are still intact
+    void Unintern(Ref ref);
+
+    // releases memory held outside the heap
+    void FreeExternal(const TagView<Tag::OWNED_ATOM,16>& atomown)
+    {
+        if (atomown.data == nullptr) return; // handed on by Promote
+        m_stats.malloc_bytes -= atomown.size;
+        std::free(atomown.data);
+    }
+    void FreeExternal(const TagView<Tag::FUNC_EXT,16>& func_ext)
+    {
+        if (func_ext.state == nullptr) return;
+        m_stats.malloc_bytes -= m_func_ext_size[static_cast<size_t>(func_ext.funcid)];
+        std::free(const_cast<void*>(static_cast<const void*>(func_ext.state)));
+    }
+
+    // calls fn(ref) for each allocated chunk in block, in address order
+    template<typename Fn>
+    void ForEachAllocated(uint16_t block, Fn&& fn)
+    {
+        for (uint16_t chunk = 0; chunk < CHUNK_COUNT; ) {
+            Ref ref{{.block = block, .chunk = chunk}};
+            if (auto free_sz = FreeSizeAt(ref); free_sz) {
+                chunk += free_sz->chunk_size();
+                continue;
+            }
+            Shift16 sz = GetChunk(ref)->taginfo().size;
+            fn(ref);
+            chunk += sz.chunk_size();
+        }
+    }
+
+    // copies region chunks reachable from ref into the main heap
+    Ref Promote(Ref ref);
+    // drops references from region chunks to the main heap
+    void SweepRegion();
+
 public:
-    Allocator();
+    explicit Allocator(HugePages huge_pages = HugePages::NONE);
+    // Maps prelude's blocks read-only below any this allocator hands out,
+    // so its roots can be used directly; refcounting them is a no-op.
+    explicit Allocator(std::shared_ptr<const Prelude> prelude, HugePages huge_pages = HugePages::NONE);
+    ~Allocator();
+
+    Allocator(const Allocator&) = delete;
+    Allocator& operator=(const Allocator&) = delete;
 
     void DumpChunks(std::source_location sloc=std::source_location::current())
     {
-        std::cout << strprintf("%s:%d - Blocks: %d", sloc.file_name(), sloc.line(), m_blocks.size()) << std::endl;
-        Ref ref{NULLREF};
-        for (ref.block = 0; ref.block < m_blocks.size(); ++ref.block) {
-            std::cout << ref.block << ":";
-            ref.chunk = 0;
-            while (ref.chunk < CHUNK_COUNT) {
-                Chunk* chunk = GetChunk(ref);
-                auto tag = chunk->taginfo();
-                std::cout << strprintf(" %d%s%d", refs(ref), (tag.free ? "_" : "*"), tag.size.byte_size());
-                ref.chunk += tag.size.chunk_size();
+        FlushCache();
+        std::cout << strprintf("%s:%d - Blocks: %d", sloc.file_name(), sloc.line(), m_block_count) << std::endl;
+        for (uint16_t block = 0; block < m_block_count; ++block) {
+            std::cout << block << (m_region_block[block] ? "R:" : ":");
+            if (IsPrelude(Ref{{.block = block, .chunk = 0}})) {
+                std::cout << " prelude" << std::endl;
+                continue;
+            }
+            if (IsDecommitted(block)) {
+                std::cout << " decommitted" << std::endl;
+                continue;
+            }
+            uint16_t chunk = 0;
+            while (chunk < CHUNK_COUNT) {
+                Ref ref{{.block = block, .chunk = chunk}};
+                if (auto free_sz = FreeSizeAt(ref); free_sz) {
+                    std::cout << strprintf(" 0_%d", free_sz->byte_size());
+                    chunk += free_sz->chunk_size();
+                } else {
+                    auto tag = GetChunk(ref)->taginfo();
+                    std::cout << strprintf(" %d*%d", refs(ref), tag.size.byte_size());
+                    chunk += tag.size.chunk_size();
+                }
             }
             std::cout << std::endl;
         }
     }
 
+    // Hands empty blocks back to the OS until at most `keep` remain; returns number released
+    size_t Trim(size_t keep=0);
+    // Empty blocks beyond this are trimmed as soon as they are coalesced
+    void SetRetainEmpty(size_t keep) { m_retain_empty = keep; Trim(keep); }
+    // Commits and prefaults blocks until at least n are committed, and
+    // retains up to n empty blocks so they aren't trimmed straight away
+    void Reserve(size_t n);
+
+    // Writes the heap, its free bitmaps and roots to path. Atom data held
+    // outside the heap is copied into the file; returns false on I/O errors,
+    // or if the heap holds ERROR or FUNC_EXT chunks, which point into the
+    // process. Every live chunk is saved, whether reachable from roots or not.
+    bool SaveSnapshot(const std::string& path, std::span<const Ref> roots);
+    // Maps a snapshot copy-on-write into a freshly constructed allocator and
+    // returns the saved roots, which the caller now owns. Saved atom data
+    // becomes EXT_ATOMs pointing into the mapped file.
+    std::optional<std::vector<Ref>> LoadSnapshot(const std::string& path);
+
+    // While on, outside a region, deref only drops the reference and queues
+    // the chunk if it died; the queue is freed by Collect
+    void SetDeferredFree(bool deferred) { m_deferred_free = deferred; }
+    // Frees up to budget queued chunks; returns how many were freed. Not
+    // while a region is open
+    size_t Collect(size_t budget=std::numeric_limits<size_t>::max());
+    bool HasPendingFree() const { return !m_pending_work.is_null() || !m_pending_todo.is_null(); }
+
+    struct CompactResult
+    {
+        size_t moved_chunks{0};
+        size_t moved_bytes{0};
+        size_t blocks_emptied{0};
+        size_t blocks_released{0}; // emptied blocks handed back to the OS
+        std::chrono::nanoseconds elapsed{0};
+    };
+    // Moves the live chunks out of the emptiest blocks into free space
+    // elsewhere, then frees those blocks. Every Ref held outside the heap
+    // must be listed in roots, which are updated; any others become
+    // invalid. Immediates and prelude chunks never move.
+    CompactResult Compact(std::span<Ref* const> roots);
+
+    // While on, outside regions, atoms and conses with identical contents
+    // share one chunk, so equal values have equal refs. Chunks created via
+    // create_writable_span are never shared.
+    void SetInterning(bool interning) { m_interning = interning; }
+    size_t InternedCount() const { return m_intern.size(); }
+
+    // Opens a region; until EndRegion, every allocation is private to it.
+    // Only one region may be open at a time.
+    void BeginRegion();
+    // Copies result (if not NULLREF) out of the region and releases every
+    // block the region used in one pass, without walking freed structure
+    // recursively. References held by region chunks into the main heap are
+    // dropped; any other refs into the region become invalid.
+    Ref EndRegion(Ref&& result);
+    bool RegionOpen() const { return m_region_open; }
+    bool InRegion(Ref ref) const { return !ref.is_null() && !ref.is_immediate() && m_region_block[ref.block()]; }
+
+    Stats GetStats() const
+    {
+        Stats stats{m_stats};
+        stats.free = m_free.count;
+        stats.free[0] += m_tcache_count;
+        return stats;
+    }
+
+    size_t BlockCount() const { return m_stats.blocks; }
+    size_t Allocations() const { return m_stats.allocations; }
+    size_t AtomBytes() const { return m_stats.atom_bytes; }
+    size_t EmptyBlockCount() const { return m_free.count[BLOCK_EXP.sh]; }
+    size_t HighWater() const { return m_stats.high_water; }
+    void ResetHighWater() { m_stats.high_water = m_stats.blocks; }
+
     template<Tag TAG, size_t SIZE>
     Ref create(TagView<TAG,SIZE> tv)
     {
+        if constexpr (TAG == Tag::OWNED_ATOM) m_stats.malloc_bytes += tv.size;
         Ref r{allocate(SIZE)};
         set_at(r, std::move(tv));
+        CountLive(TagInfo::Allocated(TAG, SIZE), true);
         return r;
     }
 
     Ref create(std::span<const uint8_t> sp)
     {
-        if (sp.size() == 0) return nil();
-        if (sp.size() == 1 && sp[0] == 1) return one();
+        m_stats.atom_bytes += sp.size();
+        if (sp.size() <= 3) {
+            // minimally encoded small numbers are always immediates
+            if (auto n = SmallInt(sp); n && Ref::fits_immediate(*n)) return Ref::from_immediate(*n);
+        }
+        if (m_interning && !m_region_open) return Intern(sp);
+        return create_fresh(sp);
+    }
+
+    // atoms bigger than this don't fit in a block, and are malloc'd
+    static constexpr size_t MAX_LARGE_ATOM{BLOCK_SIZE - TagView<Tag::LARGE_ATOM,16>::HEADER_SIZE};
+
+    // atom sizes are held in 32 bits, so no atom, rope or not, is longer
+    static constexpr size_t MAX_ATOM_SIZE{std::numeric_limits<uint32_t>::max()};
+
+    // a LARGE_ATOM of size bytes, to be filled in by the caller
+    std::pair<Ref, std::span<uint8_t>> create_large(size_t size);
+
+    // bytes [offset, offset+size) of the atom parent, which is borrowed;
+    // substrings of atoms that live outside a 128 byte chunk share the
+    // parent's data, anything else is copied
+    Ref create_slice(Ref parent, uint32_t offset, uint32_t size);
+
+    // left followed by right, both atoms and borrowed; results too big for
+    // a 128 byte chunk are ROPEs pointing at both rather than copies, and
+    // results longer than MAX_ATOM_SIZE are errors
+    Ref create_concat(Ref left, Ref right);
+
+    // the length of an atom, including ropes, without flattening it
+    std::optional<size_t> AtomSize(Ref ref)
+    {
+        std::optional<size_t> size;
+        dispatch(ref, util::Overloaded(
+            [&]<AtomicTagView ATV>(const ATV& atv) { size = atv.span().size(); },
+            [&](const TagView<Tag::ROPE,16>& rope) { size = rope.size; },
+            [](const auto&) { }
+        ));
+        return size;
+    }
+
+    // calls fn with each contiguous piece of the atom ref in order, reading
+    // ropes without flattening them; does nothing if ref is not an atom
+    template<typename Fn>
+    void ForEachPiece(Ref ref, Fn&& fn)
+    {
+        std::vector<Ref> rest; // right halves still to visit
+        while (!ref.is_null()) {
+            Ref next{NULLREF};
+            dispatch(ref, util::Overloaded(
+                [&]<AtomicTagView ATV>(const ATV& atv) { fn(atv.span()); },
+                [&](const TagView<Tag::ROPE,16>& rope) {
+                    next = rope.left;
+                    rest.push_back(rope.right);
+                },
+                [](const auto&) { }
+            ));
+            if (next.is_null() && !rest.empty()) {
+                next = rest.back();
+                rest.pop_back();
+            }
+            ref = next;
+        }
+    }
+
+    // makes a ROPE contiguous, in place, so every ref to it sees an atom
+    void Flatten(Ref ref)
+    {
+        if (ref.is_null() || IsStatic(ref)) return;
+        if (GetChunk(ref)->data[0] == TAGBYTE<Tag::ROPE,16>) [[unlikely]] FlattenRope(ref);
+    }
+
+    // a new chunk, even when interning
+    Ref create_fresh(std::span<const uint8_t> sp)
+    {
         if (sp.size() < 12) return create<Tag::INPLACE_ATOM,16>(sp);
         if (sp.size() < 28) return create<Tag::INPLACE_ATOM,32>(sp);
         if (sp.size() < 60) return create<Tag::INPLACE_ATOM,64>(sp);
         if (sp.size() < 124) return create<Tag::INPLACE_ATOM,128>(sp);
+        if (sp.size() <= MAX_LARGE_ATOM) {
+            auto [ref, dst] = create_large(sp.size());
+            std::copy(sp.begin(), sp.end(), dst.begin());
+            return ref;
+        }
         uint8_t* ext{static_cast<uint8_t*>(std::malloc(sp.size()))};
         std::copy(sp.begin(), sp.end(), ext);
         return create<Tag::OWNED_ATOM,16>({ext, static_cast<uint32_t>(sp.size())});
@@ -514,15 +1125,19 @@ public:
 
     std::pair<Ref, std::span<uint8_t>> create_writable_span(uint32_t size)
     {
+        m_stats.atom_bytes += size;
         Ref ref{NULLREF};
         std::span<uint8_t> sp{};
         if (size <= 123) {
             static constexpr std::array<uint8_t,123> arr{};
-            ref = create(std::span{arr}.subspan(0, size));
+            ref = size == 0 ? nil() : create_fresh(std::span{arr}.subspan(0, size));
             dispatch(ref, util::Overloaded(
                 [&]<size_t SIZE>(TagView<Tag::INPLACE_ATOM,SIZE>& atv) { sp = std::span{atv.data}.subspan(0,size); },
                 [&](const auto&) { }
             ));
+        } else if (size <= MAX_LARGE_ATOM) {
+            std::tie(ref, sp) = create_large(size);
+            std::fill(sp.begin(), sp.end(), 0);
         } else {
             uint8_t* ext{static_cast<uint8_t*>(std::malloc(size))};
             sp = std::span{ext, size};
@@ -532,10 +1147,45 @@ public:
         return {ref, sp};
     }
 
+    // the bytes of atom ref, resized to size with any new bytes zeroed, for
+    // updating in place. Only when ref is the chunk's sole reference and
+    // the chunk is the heap's own to change and has room. Like the fresh
+    // atoms of create_writable_span, a small result stays a heap atom
+    // rather than becoming an immediate
+    std::optional<std::span<uint8_t>> writable_if_unique(Ref ref, size_t size)
+    {
+        if (ref.is_null() || IsStatic(ref) || IsInterned(ref)) return std::nullopt;
+        std::optional<std::span<uint8_t>> res;
+        auto resize = [&](uint8_t* data, auto& cur_size, size_t capacity) {
+            if (size > capacity) return;
+            if (size > cur_size) std::fill(data + cur_size, data + size, 0);
+            cur_size = size;
+            res = std::span{data, size};
+        };
+        dispatch(ref, util::Overloaded(
+            [&]<size_t SIZE>(TagView<Tag::INPLACE_ATOM,SIZE>& atv) {
+                if (atv.refcount.read() == 1) resize(atv.data.data(), atv.size, atv.data.size());
+            },
+            [&](TagView<Tag::LARGE_ATOM,16>& atv) {
+                if (atv.refcount.read() == 1) resize(atv.data.data(), atv.size, GetChunk(ref)->taginfo().size.byte_size() - atv.HEADER_SIZE);
+            },
+            [&](TagView<Tag::OWNED_ATOM,16>& atv) {
+                // not shrunk, as FreeExternal uncounts the malloc'd bytes by size
+                if (atv.refcount.read() == 1 && size == atv.size) resize(atv.data, atv.size, atv.size);
+            },
+            [](auto&) { } // shared or read-only data
+        ));
+        // counted as if a new atom, which it stands in for
+        if (res) m_stats.atom_bytes += size;
+        return res;
+    }
+
     Ref create(std::span<const char> sp) { return create(MakeUCharSpan(sp)); }
     Ref create(std::string_view sv) { return create(MakeUCharSpan(sv)); }
     Ref create(const char* s) { return create(std::span(s, strlen(s))); }
     Ref create(int64_t n);
+    // the atom bytes create(n) counts
+    static size_t IntAtomBytes(int64_t n);
     Ref create(int n) { return create(static_cast<int64_t>(n)); }
     Ref create(unsigned n) { return create(static_cast<int64_t>(n)); }
 
@@ -549,12 +1199,13 @@ public:
 
     Ref create(Ref&& r) { return r.take(); }
 
-    Ref create(bool b) { return bumpref(_nilone[b ? 1 : 0]); }
+    Ref create(bool b) { return Ref::from_immediate(b ? 1 : 0); }
     Ref nil() { return create(false); }
     Ref one() { return create(true); }
 
     Ref create_cons(Ref&& left, Ref&& right)
     {
+        if (m_interning && !m_region_open) return InternCons(std::move(left), std::move(right));
         return create<Buddy::Tag::CONS, 16>({.left=left.take(), .right=right.take()});
     }
 
@@ -574,16 +1225,43 @@ public:
         });
     }
 
-    Ref create_func(FuncCount funcid, Ref&& env, Ref&& state, uint32_t counter=0)
+    Ref create_func(Func funcid, Ref&& env, int64_t num)
+    {
+        TagView<Tag::FUNC_NUM,16> tv{.funcid = funcid, .env = env.take()};
+        tv.set_num(num);
+        return create(tv);
+    }
+
+    Ref create_func(FuncCount funcid, Ref&& env)
     {
-        return create<Buddy::Tag::FUNC_COUNT,16>({
+        return create<Buddy::Tag::FUNC_COUNT,32>({
             .funcid = funcid,
             .env = env.take(),
-            .state = state.take(),
-            .counter = counter,
         });
     }
 
+    // a copy of FUNC_COUNT func with arg added after the args it holds
+    Ref create_func_with_arg(Ref func, Ref&& arg)
+    {
+        auto f = *TagViewAt<Tag::FUNC_COUNT,32>(GetChunk(func));
+        assert(f.counter < f.ARGS);
+        f.refcount.write(1);
+        bumpref(f.env);
+        for (size_t i = 0; i < f.counter; ++i) bumpref(f.args[i]);
+        f.args[f.counter++] = arg.take();
+        return create(f);
+    }
+
+    template<typename State>
+    Ref create_func(FuncExt funcid, Ref&& env, const State* state)
+    {
+        if (state != nullptr) {
+            m_func_ext_size[static_cast<size_t>(funcid)] = sizeof(State);
+            m_stats.malloc_bytes += sizeof(State);
+        }
+        return create_func(funcid, std::move(env), static_cast<const void*>(state));
+    }
+
     Ref create_func(FuncExt funcid, Ref&& env, const void* state)
     {
         return create<Buddy::Tag::FUNC_EXT,16>({
@@ -598,14 +1276,77 @@ public:
         return create_func(funcid, std::move(env), NULLREF);
     }
 
-    Ref create_func(FuncCount funcid, Ref&& env)
+    Ref create_func(FuncExt funcid, Ref&& env)
     {
-        return create_func(funcid, std::move(env), NULLREF);
+        return create_func(funcid, std::move(env), nullptr);
     }
 
-    Ref create_func(FuncExt funcid, Ref&& env)
+    // whether func can be given a new state in place rather than replaced:
+    // the caller holds its only reference, and the update can't leave a
+    // chunk outside an open region pointing into it
+    bool can_update_func(Ref func)
     {
-        return create_func(funcid, std::move(env), nullptr);
+        if (func.is_null() || IsStatic(func) || (m_region_open && !InRegion(func))) return false;
+        return refs(func) == 1;
+    }
+
+    void set_func_state(Ref func, Ref&& state)
+    {
+        assert(can_update_func(func));
+        Chunk* chunk = GetChunk(func);
+        if (chunk->data[0] == TAGBYTE<Tag::FUNC_NUM,16>) {
+            // the total no longer fits unboxed
+            const auto& f = *TagViewAt<Tag::FUNC_NUM,16>(chunk);
+            TagView<Tag::FUNC,16> tv{.funcid = f.funcid, .env = f.env, .state = state.take()};
+            CountLive(chunk->taginfo(), false);
+            set_at(func, tv);
+            CountLive(chunk->taginfo(), true);
+            return;
+        }
+        auto& f = *TagViewAt<Tag::FUNC,16>(chunk);
+        Ref old{f.state};
+        f.state = state.take();
+        deref(std::move(old));
+    }
+
+    void set_func_state(Ref func, int64_t num)
+    {
+        assert(can_update_func(func));
+        Chunk* chunk = GetChunk(func);
+        if (chunk->data[0] == TAGBYTE<Tag::FUNC,16>) {
+            const auto& f = *TagViewAt<Tag::FUNC,16>(chunk);
+            Ref old{f.state};
+            TagView<Tag::FUNC_NUM,16> tv{.funcid = f.funcid, .env = f.env};
+            tv.set_num(num);
+            CountLive(chunk->taginfo(), false);
+            set_at(func, tv);
+            CountLive(chunk->taginfo(), true);
+            deref(std::move(old));
+            return;
+        }
+        TagViewAt<Tag::FUNC_NUM,16>(chunk)->set_num(num);
+    }
+
+    // adds arg after the args FUNC_COUNT func holds, in place
+    void add_func_arg(Ref func, Ref&& arg)
+    {
+        assert(can_update_func(func));
+        auto& f = *TagViewAt<Tag::FUNC_COUNT,32>(GetChunk(func));
+        assert(f.counter < f.ARGS);
+        f.args[f.counter++] = arg.take();
+    }
+
+    template<typename State>
+    void set_func_state(Ref func, const State* state)
+    {
+        assert(can_update_func(func));
+        auto& f = *TagViewAt<Tag::FUNC_EXT,16>(GetChunk(func));
+        FreeExternal(f);
+        if (state != nullptr) {
+            m_func_ext_size[static_cast<size_t>(f.funcid)] = sizeof(State);
+            m_stats.malloc_bytes += sizeof(State);
+        }
+        f.state = static_cast<const void*>(state);
     }
 
     Ref create_error(std::source_location sloc=std::source_location::current())
@@ -615,23 +1356,30 @@ public:
 
     Ref bumpref(Ref ref)
     {
-        Ref res{NULLREF};
-        dispatch(ref, util::Overloaded(
-            [&]<size_t SIZE>(const TagView<Tag::NOREFCOUNT,SIZE>&) { },
-            [&](const TagRefCount& trc) {
-                auto rc = trc.refcount.read();
-                trc.refcount.write(rc + 1);
-                res = ref;
-            }
-        ));
-        return res;
+        if (ref.is_null() || IsStatic(ref)) return ref;
+        TagRefCount* trc = RefCountAt(ref);
+        if (trc == nullptr) return NULLREF;
+        trc->refcount.write(trc->refcount.read() + 1);
+        return ref;
     }
 
-    void deref(Ref&& ref) { if (!ref.is_null()) _deref(std::move(ref)); }
+    void deref(Ref&& ref)
+    {
+        if (ref.is_null() || IsStatic(ref)) return;
+        // only the last reference needs the full treatment
+        if (TagRefCount* trc = RefCountAt(ref); trc != nullptr) {
+            auto rc = trc->refcount.read();
+            if (rc > 1) {
+                trc->refcount.write(rc - 1);
+                return;
+            }
+        }
+        _deref(std::move(ref));
+    }
 
     std::tuple<std::optional<Tag>, std::span<uint8_t>, Shift16> lookup(Ref ref)
     {
-        Chunk* chunk = GetChunk(ref);
+        Chunk* chunk = ref.is_immediate() ? ImmediateChunk(ref) : GetChunk(ref);
         auto tag = chunk->taginfo();
         if (tag.free) {
             return {std::nullopt, {}, {}};
@@ -676,78 +1424,73 @@ public:
         using enum Tag;
 
         if (ref.is_null()) return;
+        if (ref.is_immediate()) return fn(*TagViewAt<INPLACE_ATOM,16>(ImmediateChunk(ref)));
 
+        // switching on the raw byte skips decoding it; free chunks and
+        // invalid tags match no case
         Chunk* chunk = GetChunk(ref);
-        auto tag = chunk->taginfo();
-        if (tag.free || !tag.tag) return;
-        switch(*tag.tag) {
-        case NOREFCOUNT:
-            if (tag.size.sh == 0) return fn(*TagViewAt<NOREFCOUNT,16>(chunk));
-            if (tag.size.sh == 1) return fn(*TagViewAt<NOREFCOUNT,32>(chunk));
-            if (tag.size.sh == 2) return fn(*TagViewAt<NOREFCOUNT,64>(chunk));
-            if (tag.size.sh == 3) return fn(*TagViewAt<NOREFCOUNT,128>(chunk));
-            break;
-        case INPLACE_ATOM:
-            if (tag.size.sh == 0) return fn(*TagViewAt<INPLACE_ATOM,16>(chunk));
-            if (tag.size.sh == 1) return fn(*TagViewAt<INPLACE_ATOM,32>(chunk));
-            if (tag.size.sh == 2) return fn(*TagViewAt<INPLACE_ATOM,64>(chunk));
-            if (tag.size.sh == 3) return fn(*TagViewAt<INPLACE_ATOM,128>(chunk));
-            break;
-        case OWNED_ATOM:
-            return fn(*TagViewAt<OWNED_ATOM,16>(chunk));
-        case EXT_ATOM:
-            return fn(*TagViewAt<EXT_ATOM,16>(chunk));
-        case CONS:
-            return fn(*TagViewAt<CONS,16>(chunk));
-        case ERROR:
-            return fn(*TagViewAt<ERROR,16>(chunk));
-        case FUNC:
-            return fn(*TagViewAt<FUNC,16>(chunk));
-        case FUNC_COUNT:
-            return fn(*TagViewAt<FUNC_COUNT,16>(chunk));
-        case FUNC_EXT:
-            return fn(*TagViewAt<FUNC_EXT,16>(chunk));
+        switch (chunk->data[0]) {
+        case TAGBYTE<NOREFCOUNT,16>: return fn(*TagViewAt<NOREFCOUNT,16>(chunk));
+        case TAGBYTE<NOREFCOUNT,32>: return fn(*TagViewAt<NOREFCOUNT,32>(chunk));
+        case TAGBYTE<NOREFCOUNT,64>: return fn(*TagViewAt<NOREFCOUNT,64>(chunk));
+        case TAGBYTE<NOREFCOUNT,128>: return fn(*TagViewAt<NOREFCOUNT,128>(chunk));
+        case TAGBYTE<INPLACE_ATOM,16>: return fn(*TagViewAt<INPLACE_ATOM,16>(chunk));
+        case TAGBYTE<INPLACE_ATOM,32>: return fn(*TagViewAt<INPLACE_ATOM,32>(chunk));
+        case TAGBYTE<INPLACE_ATOM,64>: return fn(*TagViewAt<INPLACE_ATOM,64>(chunk));
+        case TAGBYTE<INPLACE_ATOM,128>: return fn(*TagViewAt<INPLACE_ATOM,128>(chunk));
+        case TAGBYTE<OWNED_ATOM,16>: return fn(*TagViewAt<OWNED_ATOM,16>(chunk));
+        case TAGBYTE<EXT_ATOM,16>: return fn(*TagViewAt<EXT_ATOM,16>(chunk));
+        case TAGBYTE<CONS,16>: return fn(*TagViewAt<CONS,16>(chunk));
+        case TAGBYTE<ERROR,16>: return fn(*TagViewAt<ERROR,16>(chunk));
+        case TAGBYTE<FUNC,16>: return fn(*TagViewAt<FUNC,16>(chunk));
+        case TAGBYTE<FUNC_COUNT,32>: return fn(*TagViewAt<FUNC_COUNT,32>(chunk));
+        case TAGBYTE<FUNC_EXT,16>: return fn(*TagViewAt<FUNC_EXT,16>(chunk));
+        case TAGBYTE<SLICE,32>: return fn(*TagViewAt<SLICE,32>(chunk));
+        case TAGBYTE<ROPE,16>: return fn(*TagViewAt<ROPE,16>(chunk));
+        case TAGBYTE<FUNC_NUM,16>: return fn(*TagViewAt<FUNC_NUM,16>(chunk));
+        default:
+            if (chunk->taginfo().tag == LARGE_ATOM) return fn(*TagViewAt<LARGE_ATOM,16>(chunk));
         }
     }
 };
 
-template<bool RequireMin=true>
-inline std::optional<int64_t> SmallInt(std::span<const uint8_t> sp)
+// Structures shared read-only by any number of allocators. Its blocks are
+// a memfd mapped at the start of each allocator's address space, so refs
+// into it are the same everywhere and never need refcounting.
+class Prelude
 {
-    if (sp.empty()) return 0;
-    if constexpr (RequireMin) {
-        if (sp.back() == 0x00 || sp.back() == 0x80) {
-            size_t s = sp.size();
-            if (s == 1 || (sp[s-2] & 0x80) == 0) return std::nullopt;
-        }
-    }
-    int64_t res = 0;
-    if (sp.back() & 0x80) {
-        // negative
-        for (size_t i = 0; i < sp.size(); ++i) {
-            int64_t v = sp[i];
-            if (i == sp.size() - 1) v &= 0x7F;
-            if (sp[i] != 0) {
-                 if (i >= 8) return std::nullopt;
-                 if (i == 7 && ((res > 0 && v == 0x80) || v > 0x80)) return std::nullopt;
-                 res += (-v << (8*i));
-            }
-        }
-    } else {
-        // positive
-        for (size_t i = 0; i < sp.size(); ++i) {
-            int64_t v = sp[i];
-            if (sp[i] != 0) {
-                 if (i >= 8) return std::nullopt;
-                 if (i == 7 && v >= 0x80) return std::nullopt;
-                 res += (v << (8*i));
-            }
-        }
+private:
+    int m_fd{-1};
+    size_t m_blocks{0};
+    std::vector<Ref> m_roots;
+    std::vector<void*> m_external; // malloc'd data taken over from the builder
+
+    friend class Allocator;
+
+    Prelude() = default;
+    static std::shared_ptr<const Prelude> Freeze(Allocator& alloc, std::vector<Ref> roots);
+
+public:
+    // Calls build on a fresh allocator, then freezes everything it holds;
+    // the refs build returns become roots()
+    template<typename Fn>
+    static std::shared_ptr<const Prelude> Build(Fn&& build)
+    {
+        Allocator alloc;
+        std::vector<Ref> roots = build(alloc);
+        return Freeze(alloc, std::move(roots));
     }
-    return res;
-}
+
+    ~Prelude();
+    Prelude(const Prelude&) = delete;
+    Prelude& operator=(const Prelude&) = delete;
+
+    const std::vector<Ref>& roots() const { return m_roots; }
+    size_t BlockCount() const { return m_blocks; }
+};
 
 std::string to_string(Allocator& alloc, Ref ref, bool in_list=false);
+std::string to_string(const Allocator::Stats& stats);
 
 } // Buddy namespace
 
@@ -25,11 +25,29 @@ Program::~Program()
 {
     Allocator& rawalloc = m_alloc.Allocator();
     Ref feedback{pop_feedback()};
-    rawalloc.deref(feedback.take());
+    if (!rawalloc.InRegion(feedback)) rawalloc.deref(feedback.take());
+    drop_continuations();
+    if (m_region) {
+        rawalloc.EndRegion(NULLREF);
+        m_region = false;
+    }
+}
+
+void Program::drop_continuations()
+{
+    Allocator& rawalloc = m_alloc.Allocator();
     while (!m_continuations.empty()) {
         Continuation c{pop_continuation()};
-        rawalloc.deref(c.func.take());
-        rawalloc.deref(c.args.take());
+        if (!rawalloc.InRegion(c.func)) rawalloc.deref(c.func.take());
+        if (!rawalloc.InRegion(c.args)) rawalloc.deref(c.args.take());
+    }
+}
+
+void Program::end_region()
+{
+    if (m_region) {
+        m_feedback = m_alloc.Allocator().EndRegion(pop_feedback());
+        m_region = false;
     }
 }
 
@@ -51,9 +69,11 @@ template<> struct StepParams<Func> {
     SafeView func;
     Func funcid;
     SafeView state;
+    std::optional<int64_t> num{}; // the state, when held unboxed by a FUNC_NUM
     SafeView env;
     SafeRef feedback;
     SafeRef args;
+    bool sole_owner{false}; // func dies with this step, and nothing else holds it
 
     operator Program&() { return program; }
 };
@@ -62,11 +82,12 @@ template<> struct StepParams<FuncCount> {
     Program& program;
     SafeView func;
     FuncCount funcid;
-    SafeView state;
+    std::array<SafeView, TagView<Tag::FUNC_COUNT,32>::ARGS> argv; // the first counter are set
     uint32_t counter;
     SafeView env;
     SafeRef feedback;
     SafeRef args;
+    bool sole_owner{false}; // func dies with this step, and nothing else holds it
 
     operator Program&() { return program; }
 };
@@ -79,10 +100,64 @@ template<> struct StepParams<FuncExt> {
     SafeView env;
     SafeRef feedback;
     SafeRef args;
+    bool sole_owner{false}; // func dies with this step, and nothing else holds it
 
     operator Program&() { return program; }
 };
 
+// the func with its state replaced: updated in place when this step holds
+// the only reference to it, otherwise a fresh chunk sharing its env
+template<FuncEnum FE>
+static SafeRef next_func(StepParams<FE>& params, auto&&... state)
+{
+    auto& alloc = params.program.m_alloc;
+    if (params.sole_owner && alloc.Allocator().can_update_func(params.func.take_view())) {
+        alloc.Allocator().set_func_state(params.func.take_view(), std::forward<decltype(state)>(state)...);
+        return params.func.copy();
+    }
+    return alloc.takeref(alloc.Allocator().create_func(params.funcid, params.env.copy().take(), std::forward<decltype(state)>(state)...));
+}
+
+// the state's bytes, resized to size, to update in place when the FUNC
+// being stepped, which is about to be replaced, is all that holds it
+static std::optional<std::span<uint8_t>> writable_state(StepParams<Func>& params, size_t size)
+{
+    if (!params.sole_owner) return std::nullopt;
+    return params.program.m_alloc.Allocator().writable_if_unique(params.state.take_view(), size);
+}
+
+// the result of a bytewise op: the state itself if it can be updated in
+// place, otherwise a fresh zeroed atom
+static std::pair<SafeRef, std::span<uint8_t>> bytewise_result(StepParams<Func>& params, size_t size)
+{
+    if (auto sp = writable_state(params, size); sp) return {params.state.copy(), *sp};
+    return params.program.m_alloc.create_writable_span(size);
+}
+
+static SafeRef get_env(SafeView env, int64_t env_index);
+
+static constexpr uint64_t QUOTE_STEP_COST{10};
+
+// the value of expr if BLLEVAL would produce it at once, ie expr is a
+// quote or a valid env reference, charged as the skipped BLLEVAL (and
+// QUOTE) steps would have been; otherwise null
+static SafeRef trivial_eval(Program& program, SafeView env, SafeView expr)
+{
+    if (auto s = expr.convert<int64_t>(); s) {
+        if (*s >= 0) {
+            SafeRef res = get_env(env, *s);
+            if (!res.is_null()) program.charge(Cost::STEP);
+            return res;
+        }
+    } else if (auto c = expr.convert<std::pair<SafeView, SafeView>>(); c) {
+        if (auto op = c->first.convert<int64_t>(); op && lookup_opcode(*op) == FuncVariant{QUOTE}) {
+            program.charge(Cost::STEP + QUOTE_STEP_COST);
+            return c->second.copy();
+        }
+    }
+    return env.Allocator().nullref();
+}
+
 static bool blleval_helper(auto& params)
 {
     assert(params.feedback.is_null()); // shouldn't call this function if there's feedback
@@ -92,9 +167,14 @@ static bool blleval_helper(auto& params)
         params.program.new_continuation(
              params.func.copy(),
              std::move(lr->second));
-        params.program.new_continuation(BLLEVAL,
-             params.env.copy(),
-             std::move(lr->first));
+        // skip the BLLEVAL (and QUOTE) steps for trivial args
+        if (SafeRef val = trivial_eval(params.program, params.env, lr->first); !val.is_null()) {
+            params.program.fin_value(std::move(val));
+        } else {
+            params.program.new_continuation(BLLEVAL,
+                 params.env.copy(),
+                 std::move(lr->first));
+        }
         return true;
     } else if (auto a = params.args.template convert<atomspan>(); a) {
         if (a->size() == 0) {
@@ -127,6 +207,7 @@ static SafeRef get_env(SafeView env, int64_t env_index)
             } else {
                 env = lr->second;
             }
+            env_index >>= 1;
         }
         res = env.copy();
     }
@@ -177,6 +258,8 @@ struct FuncDispatch<Func, BLLEVAL> {
 
 template<>
 struct FuncDispatch<Func, QUOTE> {
+    static constexpr uint64_t StepCost{QUOTE_STEP_COST};
+
     static void step(StepParams<Func>& params)
     {
         params.program.fin_value(std::move(params.args));
@@ -201,6 +284,11 @@ struct FuncDispatch<Func, FuncId> {
     static constexpr bool HasIdempotent = requires(const StateType& s, const ArgType& a) { static_cast<bool>(Derived::idempotent(s,a)); };
     static constexpr bool HasFinish = requires(Program& p, const StateType& s) { Derived::finish(p, s); };
     static constexpr bool HasGetState = requires(StepParams<Func>& p) { StateType{*Derived::get_state(p)}; };
+    // numeric folds return the new total itself, kept unboxed in a FUNC_NUM
+    static constexpr bool NativeState = requires(StepParams<Func>& p, const StateType& s, const ArgType& a) {
+        { Derived::binop(p, s, a) } -> std::same_as<std::optional<int64_t>>;
+    };
+    static_assert(!NativeState || (std::is_same_v<StateType, int64_t> && !HasFinish && !HasGetState));
 
     static void finish(Program& program, SafeView state)
     {
@@ -226,6 +314,9 @@ struct FuncDispatch<Func, FuncId> {
             return Derived::get_state(params);
         } else {
             auto s = params.state.convert<StateType>();
+            if constexpr (NativeState) {
+                if (params.num) s.set_value(*params.num);
+            }
             if constexpr (!InitialStateIsArg) {
                 if (!s) s.set_value(Derived::initial_state());
             }
@@ -241,9 +332,7 @@ struct FuncDispatch<Func, FuncId> {
             if (params.state.is_null()) {
                 auto a = SafeView(params.feedback).convert<ArgType>();
                 if (a) {
-                    return params.program.m_alloc.takeref(
-                        params.program.m_alloc.Allocator().create_func(
-                            params.funcid, params.env.copy().take(), params.feedback.take()));
+                    return next_func(params, params.feedback.take());
                 } else {
                     return params.program.m_alloc.error();
                 }
@@ -258,13 +347,20 @@ struct FuncDispatch<Func, FuncId> {
                 return params.func.copy();
             }
         }
-        SafeRef r = Derived::binop(params, *s, *a);
-        if (r.is_error()) {
-            return r;
+        if constexpr (NativeState) {
+            auto n = Derived::binop(params, *s, *a);
+            if (!n) return params.program.m_alloc.error();
+            if (!TagView<Tag::FUNC_NUM,16>::fits(*n)) return next_func(params, params.program.m_alloc.create(*n).take());
+            // charged as if boxed, as how big a total fits unboxed varies by build
+            params.program.charge(Allocator::IntAtomBytes(*n) * Cost::ATOM_BYTE);
+            return next_func(params, *n);
         } else {
-            return params.program.m_alloc.takeref(
-                    params.program.m_alloc.Allocator().create_func(
-                        params.funcid, params.env.copy().take(), r.take()));
+            SafeRef r = Derived::binop(params, *s, *a);
+            if (r.is_error()) {
+                return r;
+            } else {
+                return next_func(params, r.take());
+            }
         }
     }
 
@@ -279,7 +375,13 @@ struct FuncDispatch<Func, FuncId> {
             }
         } else if (blleval_helper(params)) {
             // blleval handled it
+        } else if (params.num) {
+            params.program.fin_value(params.program.m_alloc.create(*params.num));
         } else {
+            if constexpr (NativeState) {
+                // charged as creating the result from an unboxed total would be
+                if (!params.state.is_null()) params.program.charge(*params.program.m_alloc.Allocator().AtomSize(params.state.take_view()) * Cost::ATOM_BYTE);
+            }
             finish(params.program, params.state);
         }
     }
@@ -287,6 +389,8 @@ struct FuncDispatch<Func, FuncId> {
 
 template<>
 struct FuncDispatch<Func, OP_PARTIAL> {
+    static constexpr uint64_t StepCost{100};
+
     static void step(StepParams<Func>& params);
 };
 
@@ -375,15 +479,21 @@ struct FuncDefinition<OP_ANY> {
 template<>
 struct FuncDefinition<OP_STRLEN> {
     using StateType = int64_t;
-    using ArgType = atomspan;
+    using ArgType = SafeView;
 
     static int64_t initial_state() { return 0; }
 
-    static bool idempotent(int64_t, const atomspan& arg) { return arg.size() == 0; }
+    static bool idempotent(int64_t, const SafeView& arg)
+    {
+        return arg.Allocator().Allocator().AtomSize(arg.take_view()) == 0;
+    }
 
-    static SafeRef binop(Program& program, int64_t state, atomspan arg)
+    // ropes know their own length, so are never flattened just to measure
+    static std::optional<int64_t> binop(Program&, int64_t state, const SafeView& arg)
     {
-        return program.m_alloc.create(state + static_cast<int64_t>(arg.size()));
+        auto size = arg.Allocator().Allocator().AtomSize(arg.take_view());
+        if (!size) return std::nullopt; // STRLEN only accepts atoms
+        return state + static_cast<int64_t>(*size);
     }
 };
 
@@ -433,32 +543,40 @@ struct FuncDefinition<OP_LT_STR> {
 
 template<>
 struct FuncDefinition<OP_CAT> {
-    using StateType = atomspan;
-    using ArgType = atomspan;
+    using StateType = SafeView;
+    using ArgType = SafeView;
 
-    static atomspan initial_state() { return {}; }
+    static std::optional<SafeView> get_state(StepParams<Func>& params)
+    {
+        return params.state;
+    }
 
-    static bool idempotent(const atomspan&, const atomspan& arg) { return arg.size() == 0; }
+    static bool idempotent(const SafeView&, const SafeView& arg)
+    {
+        return arg.Allocator().Allocator().AtomSize(arg.take_view()) == 0;
+    }
 
-    static SafeRef binop(Program& program, atomspan state, atomspan arg)
+    // appends in place while the state has room, otherwise big results are
+    // ropes, so each argument costs O(1) however long the string built so far
+    static SafeRef binop(StepParams<Func>& params, SafeView state, SafeView arg)
     {
-        size_t sz = state.size() + arg.size();
-        std::span<uint8_t> dst;
-        std::array<uint8_t, 123> arr;
-        uint8_t* owned{nullptr};
-        if (sz <= arr.size()) {
-            dst = std::span{arr}.subspan(0, sz);
-        } else {
-            owned = static_cast<uint8_t*>(std::malloc(sz));
-            dst = std::span{owned, sz};
-        }
-        auto mid = std::copy(state.begin(), state.end(), dst.begin());
-        std::copy(arg.begin(), arg.end(), mid);
-        if (owned == nullptr) {
-            return program.m_alloc.create(dst);
-        } else {
-            return program.m_alloc.create_owned(dst);
+        auto& alloc = params.program.m_alloc.Allocator();
+        auto arg_size = alloc.AtomSize(arg.take_view());
+        if (!arg_size) return params.program.m_alloc.error(); // CAT only accepts atoms
+        if (state.is_null()) return arg.copy();
+        const size_t state_size{*alloc.AtomSize(state.take_view())};
+        if (*arg_size > Allocator::MAX_ATOM_SIZE - state_size) return params.program.m_alloc.error(); // result too long
+        if (auto sp = writable_state(params, state_size + *arg_size); sp) {
+            auto it = sp->begin() + state_size;
+            alloc.ForEachPiece(arg.take_view(), [&](std::span<const uint8_t> piece) { it = std::copy(piece.begin(), piece.end(), it); });
+            return state.copy();
         }
+        return params.program.m_alloc.takeref(alloc.create_concat(state.take_view(), arg.take_view()));
+    }
+
+    static void finish(Program& program, SafeView state)
+    {
+        program.fin_value(state.is_null() ? program.m_alloc.nil() : state.copy());
     }
 };
 
@@ -469,15 +587,13 @@ struct FuncDefinition<OP_AND_BYTES> {
 
     static constexpr bool InitialStateIsArg = true;
 
-    static SafeRef binop(Program& program, atomspan state, atomspan arg)
+    static SafeRef binop(StepParams<Func>& params, atomspan state, atomspan arg)
     {
         size_t sz = std::max(state.size(), arg.size());
-        auto [r, sp] = program.m_alloc.create_writable_span(sz);
+        auto [r, sp] = bytewise_result(params, sz);
         assert(sp.size() == sz);
 
-        for (size_t i = 0; i < state.size(); ++i) {
-            sp[i] = state[i];
-        }
+        if (sp.data() != state.data()) std::copy(state.begin(), state.end(), sp.begin());
         for (size_t i = 0; i < arg.size(); ++i) {
             sp[i] &= arg[i];
         }
@@ -492,10 +608,10 @@ struct FuncDefinition<OP_NAND_BYTES> {
 
     static atomspan initial_state() { return {}; }
 
-    static SafeRef binop(Program& program, atomspan state, atomspan arg)
+    static SafeRef binop(StepParams<Func>& params, atomspan state, atomspan arg)
     {
         size_t sz = std::max(state.size(), arg.size());
-        auto [r, sp] = program.m_alloc.create_writable_span(sz);
+        auto [r, sp] = bytewise_result(params, sz);
         assert(sp.size() == sz);
 
         // state is "NOT(previous)"
@@ -524,15 +640,13 @@ struct FuncDefinition<OP_OR_BYTES> {
 
     static bool idempotent(const atomspan&, const atomspan& arg) { return arg.size() == 0; }
 
-    static SafeRef binop(Program& program, atomspan state, atomspan arg)
+    static SafeRef binop(StepParams<Func>& params, atomspan state, atomspan arg)
     {
         size_t sz = std::max(state.size(), arg.size());
-        auto [r, sp] = program.m_alloc.create_writable_span(sz);
+        auto [r, sp] = bytewise_result(params, sz);
         assert(sp.size() == sz);
 
-        for (size_t i = 0; i < state.size(); ++i) {
-            sp[i] = state[i];
-        }
+        if (sp.data() != state.data()) std::copy(state.begin(), state.end(), sp.begin());
         for (size_t i = 0; i < arg.size(); ++i) {
             sp[i] |= arg[i];
         }
@@ -549,15 +663,13 @@ struct FuncDefinition<OP_XOR_BYTES> {
 
     static bool idempotent(const atomspan&, const atomspan& arg) { return arg.size() == 0; }
 
-    static SafeRef binop(Program& program, atomspan state, atomspan arg)
+    static SafeRef binop(StepParams<Func>& params, atomspan state, atomspan arg)
     {
         size_t sz = std::max(state.size(), arg.size());
-        auto [r, sp] = program.m_alloc.create_writable_span(sz);
+        auto [r, sp] = bytewise_result(params, sz);
         assert(sp.size() == sz);
 
-        for (size_t i = 0; i < state.size(); ++i) {
-            sp[i] = state[i];
-        }
+        if (sp.data() != state.data()) std::copy(state.begin(), state.end(), sp.begin());
         for (size_t i = 0; i < arg.size(); ++i) {
             sp[i] ^= arg[i];
         }
@@ -574,14 +686,13 @@ struct FuncDefinition<OP_ADD> {
 
     static bool idempotent(int64_t, int64_t arg) { return arg == 0; }
 
-    static SafeRef binop(Program& program, int64_t state, int64_t arg)
+    static std::optional<int64_t> binop(Program&, int64_t state, int64_t arg)
     {
         if ((arg >= 0 && std::numeric_limits<int64_t>::max() - arg >= state)
-            || (arg < 0 && std::numeric_limits<int64_t>::min() - arg >= state)) {
-            return program.m_alloc.create(state + arg);
+            || (arg < 0 && std::numeric_limits<int64_t>::min() - arg <= state)) {
+            return state + arg;
         } else {
-            program.m_alloc.error();
-            return program.m_alloc.nullref();
+            return std::nullopt; // overflow
         }
     }
 };
@@ -594,6 +705,7 @@ struct FuncDispatch<FuncCount, FuncId> {
     static constexpr size_t MinArgs = Derived::MinArgs;
     static constexpr size_t MaxArgs = std::tuple_size_v<ArgTup>;
     static_assert(MinArgs <= MaxArgs);
+    static_assert(MaxArgs <= TagView<Tag::FUNC_COUNT,32>::ARGS);
 
     template<typename T> struct ArgTup2ConvTup;
     template<typename... T> struct ArgTup2ConvTup<std::tuple<T...>> { using type = std::tuple<SafeConv::ConvertRef<T>...>; };
@@ -621,14 +733,14 @@ struct FuncDispatch<FuncCount, FuncId> {
 
     static SafeRef partial_step(StepParams<FuncCount>& params)
     {
+        auto& alloc = params.program.m_alloc;
         if (params.counter >= MaxArgs) {
-            return params.program.m_alloc.error(); // too many arguments
+            return alloc.error(); // too many arguments
+        } else if (params.sole_owner && alloc.Allocator().can_update_func(params.func.take_view())) {
+            alloc.Allocator().add_func_arg(params.func.take_view(), params.feedback.take());
+            return params.func.copy();
         } else {
-            SafeRef new_state = params.program.m_alloc.cons(std::move(params.feedback), params.state.copy());
-            return params.program.m_alloc.takeref(
-                       params.program.m_alloc.Allocator().create_func(
-                           params.funcid, params.env.copy().take(),
-                           new_state.take(), params.counter+1));
+            return alloc.takeref(alloc.Allocator().create_func_with_arg(params.func.take_view(), params.feedback.take()));
         }
     }
 
@@ -649,21 +761,9 @@ struct FuncDispatch<FuncCount, FuncId> {
         if (params.counter > MaxArgs) return params.program.error(); // internal error: too many arguments, should be caught earlier
 
         // finalisation
-        auto ref_arr = make_filled_array<SafeView,MaxArgs>(params.program.m_alloc.nullref());
-        SafeView backarg = params.state;
-        for (int64_t i = params.counter - 1; i >= 0; --i) {
-            if (auto cons = backarg.convert<std::pair<SafeView,SafeView>>(); cons) {
-                ref_arr[i] = cons->first;
-                backarg = cons->second;
-            } else {
-                return params.program.error(); // internal error, state/counter mismatch (counter high)
-            }
-        }
-        if (!backarg.is_null()) return params.program.error(); // internal error, state/counter mismatch (counter low)
-
         constexpr auto idx_seq = std::make_index_sequence<MaxArgs>{};
         auto tup_arr = [&]<size_t... Is>(std::index_sequence<Is...>) -> ConvTup {
-            return ConvTup{std::get<Is>(ref_arr).template convert<std::tuple_element_t<Is, ArgTup>>()...};
+            return ConvTup{std::get<Is>(params.argv).template convert<std::tuple_element_t<Is, ArgTup>>()...};
         }(idx_seq);
 
         auto check = [&]<size_t... Is>(std::index_sequence<Is...>) -> bool {
@@ -691,6 +791,7 @@ template<>
 struct FuncDefinition<OP_APPLY> {
     using ArgTup = std::tuple<SafeView, SafeView>;
     static constexpr size_t MinArgs = 1;
+    static constexpr uint64_t StepCost{100}; // starts a fresh evaluation
 
     template<size_t I>
     static SafeView get_default(Program& program)
@@ -756,16 +857,20 @@ struct FuncDefinition<OP_LIST> {
 
 template<>
 struct FuncDefinition<OP_SUBSTR> {
-    using ArgTup = std::tuple<atomspan,int64_t,int64_t>;
+    using ArgTup = std::tuple<SafeView,int64_t,int64_t>;
     static constexpr size_t MinArgs = 1;
 
     static constexpr std::tuple<int64_t,int64_t> Defaults{0,std::numeric_limits<int64_t>::max()};
-    static SafeRef fixop(StepParams<FuncCount>& params, atomspan sp, int64_t start, int64_t size)
+    static SafeRef fixop(StepParams<FuncCount>& params, const SafeView& atom, int64_t start, int64_t size)
     {
-        start = std::clamp<int64_t>(start, -static_cast<int64_t>(sp.size()), static_cast<int64_t>(sp.size()));
-        if (start < 0) start = sp.size() + start;
-        size = std::clamp<int64_t>(size, 0, sp.size() - start);
-        return params.program.m_alloc.create(sp.subspan(start, size));
+        // the atom itself rather than its span, so the result can share its data
+        auto sp = atom.convert<atomspan>();
+        if (!sp) return params.program.m_alloc.error(); // not an atom
+        const int64_t len = sp->size();
+        start = std::clamp<int64_t>(start, -len, len);
+        if (start < 0) start = len + start;
+        size = std::clamp<int64_t>(size, 0, len - start);
+        return params.program.m_alloc.create_slice(atom, start, size);
     }
 };
 
@@ -796,10 +901,7 @@ struct FuncDispatch<FuncExt, FuncId> {
         State* r = Derived::extop(params.program, static_cast<const State*>(params.state), *a); // work()
         if (r == nullptr) return params.program.m_alloc.error(); // internal failure
 
-        return params.program.m_alloc.takeref(
-                   params.program.m_alloc.Allocator().create_func(
-                       params.funcid, params.env.copy().take(),
-                       static_cast<const void*>(r)));
+        return next_func(params, r);
     }
 
     static void step(StepParams<FuncExt>& params)
@@ -824,12 +926,19 @@ struct FuncDispatch<FuncExt, FuncId> {
 template<>
 struct FuncDefinition<OP_SHA256> {
     using State = CSHA256;
-    using ArgType = atomspan;
+    using ArgType = SafeView;
+    static constexpr uint64_t StepCost{100}; // plus HASH_BYTE per byte hashed
 
-    static CSHA256* extop(Program&, const CSHA256* state, atomspan arg)
+    static CSHA256* extop(Program& program, const CSHA256* state, const SafeView& arg)
     {
+        // ropes are hashed a piece at a time, without flattening them
+        auto& alloc = program.m_alloc.Allocator();
+        const auto size = alloc.AtomSize(arg.take_view());
+        if (!size) return nullptr; // not an atom
+        program.charge(*size * Cost::HASH_BYTE);
+        if (program.cost() > program.budget()) return nullptr; // fail before hashing
         CSHA256* x = DupeObject<CSHA256>(state);
-        x->Write(arg.data(), arg.size());
+        alloc.ForEachPiece(arg.take_view(), [&](std::span<const uint8_t> sp) { x->Write(sp.data(), sp.size()); });
         return x;
     }
 
@@ -862,12 +971,24 @@ struct FuncEnumDispatcher {
         }
     };
 
+    static constexpr auto get_step_cost = []<typename T>() -> uint64_t {
+        if constexpr (requires { T::StepCost; }) {
+            return T::StepCost;
+        } else if constexpr (requires { T::Derived::StepCost; }) {
+            return T::Derived::StepCost;
+        } else {
+            return Cost::STEP;
+        }
+    };
+
     static constexpr auto step_dispatch = mk_dispatch_table<get_step_fn, FuncDispatch>();
+    static constexpr auto step_cost = mk_dispatch_table<get_step_cost, FuncDispatch>();
     static constexpr auto partial_step_dispatch = mk_dispatch_table<get_partial_step_fn, FuncDispatch>();
 };
 
 struct FuncEnumDispatch {
     static constexpr auto step = []<FuncEnum FE>(StepParams<FE>&& params) -> void {
+        params.program.charge(FuncEnumDispatcher<FE>::step_cost[static_cast<size_t>(params.funcid)]);
         return (FuncEnumDispatcher<FE>::step_dispatch[static_cast<size_t>(params.funcid)])(params);
     };
 
@@ -882,7 +1003,7 @@ struct FuncEnumDispatch {
 };
 
 template<typename Dispatcher>
-static void Dispatch(Dispatcher&& dispatcher, Program& program, SafeView func, SafeRef&& feedback, SafeRef&& args)
+static void Dispatch(Dispatcher&& dispatcher, Program& program, SafeView func, SafeRef&& feedback, SafeRef&& args, bool sole_owner=false)
 {
     SafeAllocator& m_alloc = program.m_alloc;
 
@@ -896,18 +1017,35 @@ static void Dispatch(Dispatcher&& dispatcher, Program& program, SafeView func, S
                 .env=m_alloc.view(f.env),
                 .feedback=std::move(feedback),
                 .args=std::move(args),
+                .sole_owner=sole_owner,
+            });
+        },
+        [&](const TagView<Tag::FUNC_NUM,16>& f) {
+            dispatcher.template operator()<Func>({
+                .program=program,
+                .func=func,
+                .funcid=f.funcid,
+                .state=m_alloc.nullview(),
+                .num=f.num(),
+                .env=m_alloc.view(f.env),
+                .feedback=std::move(feedback),
+                .args=std::move(args),
+                .sole_owner=sole_owner,
             });
         },
-        [&](const TagView<Tag::FUNC_COUNT,16>& f) {
+        [&](const TagView<Tag::FUNC_COUNT,32>& f) {
             dispatcher.template operator()<FuncCount>({
                 .program=program,
                 .func=func,
                 .funcid=f.funcid,
-                .state=m_alloc.view(f.state),
+                .argv=[&]<size_t... Is>(std::index_sequence<Is...>) {
+                    return std::array{m_alloc.view(f.args[Is])...};
+                }(std::make_index_sequence<std::tuple_size_v<decltype(f.args)>>{}),
                 .counter=f.counter,
                 .env=m_alloc.view(f.env),
                 .feedback=std::move(feedback),
                 .args=std::move(args),
+                .sole_owner=sole_owner,
             });
         },
         [&](const TagView<Tag::FUNC_EXT,16>& f) {
@@ -919,6 +1057,7 @@ static void Dispatch(Dispatcher&& dispatcher, Program& program, SafeView func, S
                 .env=m_alloc.view(f.env),
                 .feedback=std::move(feedback),
                 .args=std::move(args),
+                .sole_owner=sole_owner,
             });
         },
         [&](const auto&) {
@@ -981,7 +1120,9 @@ void FuncDispatch<Func, OP_PARTIAL>::step(StepParams<Func>& params)
             new_state = FuncEnumDispatch::partial_step.template operator()<FE>(std::move(params));
         };
 
-        Dispatch(ps_result, params.program, params.state, std::move(params.feedback), params.state.nullref());
+        // the inner func is ours alone if we hold the only reference to it
+        const bool inner_sole_owner{params.sole_owner && params.program.m_alloc.Allocator().refs(params.state.take_view()) == 1};
+        Dispatch(ps_result, params.program, params.state, std::move(params.feedback), params.state.nullref(), inner_sole_owner);
     }
 
     assert(!params.args.is_null());
@@ -989,37 +1130,71 @@ void FuncDispatch<Func, OP_PARTIAL>::step(StepParams<Func>& params)
     if (new_state.is_error()) {
         params.program.fin_value(std::move(new_state));
     } else {
-        params.program.new_continuation(
-            params.program.m_alloc.takeref(
-                params.program.m_alloc.Allocator().create_func(
-                    params.funcid, params.env.copy().take(), new_state.take())),
-            std::move(params.args));
+        params.program.new_continuation(next_func(params, new_state.take()), std::move(params.args));
     }
 }
 
 } // anonymous namespace
 
-void Program::step()
+void Program::step_top(Allocator& rawalloc)
 {
-    if (m_continuations.empty()) return; // nothing to do
-
-    Allocator& rawalloc = m_alloc.Allocator();
-
     if (rawalloc.is_error(m_feedback)) {
          // terminal error state: clear/free continuations
-         while (!m_continuations.empty()) {
-              Continuation c{pop_continuation()};
-              rawalloc.deref(c.func.take());
-              rawalloc.deref(c.args.take());
-         }
-         return;
+         drop_continuations();
+         return end_region();
+    }
+
+    const size_t atom_bytes{rawalloc.AtomBytes()};
+    {
+        Ref feedback{pop_feedback()};
+        Continuation cont{pop_continuation()};
+
+        SafeRef func{m_alloc.takeref(cont.func.take())};
+        const bool sole_owner{rawalloc.refs(SafeView{func}.take_view()) == 1};
+        Dispatch(FuncEnumDispatch::step, *this, func, m_alloc.takeref(feedback.take()), m_alloc.takeref(cont.args.take()), sole_owner);
     }
+    charge((rawalloc.AtomBytes() - atom_bytes) * Cost::ATOM_BYTE);
+    if (m_cost > m_budget) [[unlikely]] over_budget();
 
+    // all refs from this step have been released
+    if (m_continuations.empty()) end_region();
+}
+
+void Program::over_budget()
+{
+    Allocator& rawalloc = m_alloc.Allocator();
     Ref feedback{pop_feedback()};
-    Continuation cont{pop_continuation()};
+    if (!rawalloc.InRegion(feedback)) rawalloc.deref(feedback.take());
+    drop_continuations();
+    error();
+}
+
+void Program::step()
+{
+    if (m_continuations.empty()) return; // nothing to do
+    step_top(m_alloc.Allocator());
+}
 
-    SafeRef func{m_alloc.takeref(cont.func.take())};
-    return Dispatch(FuncEnumDispatch::step, *this, func, m_alloc.takeref(feedback.take()), m_alloc.takeref(cont.args.take()));
+Program::RunResult Program::run(size_t max_steps)
+{
+    Allocator& rawalloc = m_alloc.Allocator();
+    const size_t allocations{rawalloc.Allocations()};
+    size_t steps{0};
+    size_t max_depth{m_continuations.size()};
+    while (steps < max_steps && !m_continuations.empty()) {
+        step_top(rawalloc);
+        ++steps;
+        max_depth = std::max(max_depth, m_continuations.size());
+    }
+    return RunResult{
+        .value = finished() ? inspect_feedback() : m_alloc.nullview(),
+        .finished = finished(),
+        .error = finished() && rawalloc.is_error(m_feedback),
+        .steps = steps,
+        .max_depth = max_depth,
+        .allocations = rawalloc.Allocations() - allocations,
+        .cost = m_cost,
+    };
 }
 
 } // Execution namespace
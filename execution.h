@@ -8,11 +8,24 @@
 #include <logging.h>
 
 #include <array>
+#include <cstdint>
+#include <limits>
 #include <optional>
 #include <vector>
 
 namespace Execution {
 
+// Evaluation is charged deterministically: each step costs its func's base
+// cost, plus a cost for every byte of atom created or hashed
+struct Cost
+{
+    static constexpr uint64_t STEP{50}; // unless the func sets its own StepCost
+    static constexpr uint64_t ATOM_BYTE{1};
+    static constexpr uint64_t HASH_BYTE{4};
+
+    static constexpr uint64_t UNLIMITED{std::numeric_limits<uint64_t>::max()};
+};
+
 struct Continuation
 {
     Buddy::Ref func; // function, state and environment
@@ -48,7 +61,11 @@ private:
     std::vector<Continuation> m_continuations;
     Buddy::Ref m_feedback{NULLREF};
 
+    bool m_region{false}; // evaluating inside an allocator region
+
     // costings
+    uint64_t m_cost{0};
+    uint64_t m_budget{Cost::UNLIMITED};
 
     // CTransactionRef tx;
     // int input_idx;
@@ -67,13 +84,28 @@ private:
         return c;
     }
 
+    // steps the top continuation, given there is one
+    void step_top(Buddy::Allocator& rawalloc);
+    // abandons evaluation, leaving an error as the result
+    void over_budget();
+
+    // releases continuations, other than refs into our region
+    void drop_continuations();
+    // promotes the result out of our region and discards the region
+    void end_region();
 
 public:
     template<typename T> struct Logic;
-    explicit Program(SafeAllocator& alloc LIFETIMEBOUND, SafeRef&& sexpr, SafeRef&& env)
-        : m_alloc{alloc}, m_feedback{NULLREF}
+
+    // With region set, every allocation made while evaluating is private to
+    // the program, and is released in bulk once it finishes or is destroyed.
+    // The allocator must not be otherwise used until then.
+    // Evaluation fails as soon as its cost exceeds budget.
+    explicit Program(SafeAllocator& alloc LIFETIMEBOUND, SafeRef&& sexpr, SafeRef&& env, bool region=false, uint64_t budget=Cost::UNLIMITED)
+        : m_alloc{alloc}, m_feedback{NULLREF}, m_region{region}, m_budget{budget}
     {
         m_continuations.reserve(1024);
+        if (m_region) m_alloc.Allocator().BeginRegion();
         eval_sexpr(std::move(sexpr), std::move(env));
     }
 
@@ -93,6 +125,16 @@ public:
         return m_continuations;
     }
 
+    // every ref the program holds, for Allocator::Compact
+    void AddRoots(std::vector<Buddy::Ref*>& roots)
+    {
+        roots.push_back(&m_feedback);
+        for (auto& c : m_continuations) {
+            roots.push_back(&c.func);
+            roots.push_back(&c.args);
+        }
+    }
+
     void new_continuation(Buddy::Ref&& func, Buddy::Ref&& args);
 
     void new_continuation(SafeRef&& func, SafeRef&& args)
@@ -105,6 +147,10 @@ public:
         new_continuation(m_alloc.create(funcid, std::move(env)), std::move(args));
     }
 
+    void charge(uint64_t cost) { m_cost += cost; }
+    uint64_t cost() const { return m_cost; }
+    uint64_t budget() const { return m_budget; }
+
     void fin_value(Buddy::Ref&& val);
     void fin_value(SafeRef&& val) { fin_value(val.take()); }
     void error(std::source_location sloc=std::source_location::current())
@@ -121,6 +167,20 @@ public:
     void step();
 
     bool finished() { return m_continuations.empty(); }
+
+    struct RunResult
+    {
+        SafeView value; // the program's result or error; null if unfinished
+        bool finished{false};
+        bool error{false};
+        size_t steps{0};
+        size_t max_depth{0}; // most continuations pending at once
+        size_t allocations{0}; // chunks allocated while running
+        uint64_t cost{0}; // charged so far, including earlier runs
+    };
+
+    // steps until finished, or until max_steps steps have been taken
+    RunResult run(size_t max_steps=std::numeric_limits<size_t>::max()) LIFETIMEBOUND;
 };
 
 } // Execution namespace
@@ -9,8 +9,11 @@
 
 #include <logging.h>
 
+#include <filesystem>
 #include <ranges>
 #include <iostream>
+#include <limits>
+#include <optional>
 
 void test3(ElView ev=ElView{nullptr}) { (void)ev; }
 
@@ -72,7 +75,7 @@ void run(Execution::Program& program)
     std::cout << "START program" << std::endl;
     dump_cont(program);
     while (!program.finished()) {
-        program.step();
+        program.run(1);
         dump_cont(program);
     }
     std::cout << "END" << std::endl;
@@ -173,6 +176,250 @@ void test9(Buddy::Allocator& alloc)
 
     for (auto& x : r) { alloc.deref(std::move(x)); }
     alloc.DumpChunks();
+
+    {
+        // a snapshot maps back into a fresh allocator with the same contents
+        static const std::string text(300, 's');
+        const std::string path{std::filesystem::temp_directory_path() / "bll-test.snapshot"};
+        Buddy::Allocator source;
+        Buddy::Ref saved = source.create_list("hello", 12345678, std::string_view{text}, source.create_list(7, 8));
+        const std::string expect{to_string(source, saved)};
+        bool ok = source.SaveSnapshot(path, std::span{&saved, 1});
+        assert(ok);
+        source.deref(std::move(saved));
+
+        Buddy::Allocator loaded;
+        auto roots = loaded.LoadSnapshot(path);
+        std::filesystem::remove(path);
+        assert(roots && roots->size() == 1);
+        assert(to_string(loaded, roots->front()) == expect);
+        loaded.deref(std::move(roots->front()));
+        assert(loaded.GetStats().live_chunks() == 0);
+    }
+
+    {
+        // a prelude is shared read-only by allocators built on it
+        static const std::string text(300, 'p');
+        auto prelude = Buddy::Prelude::Build([&](Buddy::Allocator& a) {
+            return std::vector<Buddy::Ref>{a.create_list("table", 1, 2, 3), a.create(std::string_view{text})};
+        });
+        std::string expect;
+        for (int i = 0; i < 2; ++i) {
+            Buddy::Allocator user{prelude};
+            Buddy::Ref l = user.create_cons(user.bumpref(prelude->roots()[0]), user.bumpref(prelude->roots()[1]));
+            const std::string got{to_string(user, l)};
+            if (i == 0) expect = got;
+            assert(got == expect);
+            user.deref(std::move(l));
+            assert(user.GetStats().live_chunks() == 0);
+            assert(to_string(user, prelude->roots()[0]) == "(\"table\" 1 2 3)");
+        }
+    }
+
+    {
+        // a trimmed block reused by a region is the region's alone, so
+        // trimming during the region doesn't find it once it's empty again;
+        // freeing back to front leaves block 0 the one trimmed and reused
+        Buddy::Allocator trimmed;
+        const size_t live{trimmed.GetStats().live_chunks()};
+        std::vector<Buddy::Ref> conses;
+        for (size_t i = 0; i < Buddy::CHUNK_COUNT * 5 / 2; ++i) conses.push_back(trimmed.create_cons(trimmed.nil(), trimmed.nil()));
+        for (auto& r : conses | std::views::reverse) trimmed.deref(std::move(r));
+        assert(trimmed.Trim(1) == 1);
+        trimmed.BeginRegion();
+        trimmed.deref(trimmed.create_cons(trimmed.nil(), trimmed.nil()));
+        assert(trimmed.Trim(0) == 1);
+        Buddy::Ref r = trimmed.EndRegion(trimmed.create_cons(trimmed.nil(), trimmed.one()));
+        trimmed.deref(std::move(r));
+        assert(trimmed.GetStats().live_chunks() == live);
+    }
+
+    {
+        // deferred frees are only done by Collect, a budget at a time
+        Buddy::Allocator deferred;
+        const size_t empty{deferred.GetStats().live_chunks()};
+        Buddy::Ref l = deferred.nil();
+        for (int i = 0; i < 10000; ++i) l = deferred.create_cons(deferred.create(i + 1000000), std::move(l));
+        const size_t live{deferred.GetStats().live_chunks()};
+        deferred.SetDeferredFree(true);
+        deferred.deref(std::move(l));
+        assert(deferred.HasPendingFree() && deferred.GetStats().live_chunks() == live);
+        size_t freed{0};
+        while (deferred.HasPendingFree()) {
+            size_t n = deferred.Collect(1000);
+            assert(n <= 1000);
+            freed += n;
+        }
+        assert(freed == live - empty);
+        assert(deferred.GetStats().live_chunks() == empty);
+        deferred.SetDeferredFree(false);
+    }
+
+    {
+        // freeing a FUNC_COUNT queues its children in its own chunk, so
+        // allocates nothing however many of them are left to free
+        Buddy::Allocator counted;
+        for (int nargs = 0; nargs <= 3; ++nargs) {
+            Buddy::Ref f = counted.create_func(OP_SUBSTR, counted.create_list(1000000, 2));
+            for (int i = 0; i < nargs; ++i) counted.add_func_arg(f, counted.create_list(i + 1000000, counted.create_list(3, 4)));
+            Buddy::Ref l = counted.create_cons(std::move(f), counted.create_list(5, 6));
+            const size_t allocations{counted.Allocations()};
+            counted.deref(std::move(l));
+            assert(counted.Allocations() == allocations);
+            assert(counted.GetStats().live_chunks() == 0);
+        }
+    }
+
+    {
+        // Compact moves the survivors of a sparse heap without changing them
+        static const std::string text(200, 'c');
+        Buddy::Allocator sparse;
+        std::vector<Buddy::Ref> all, kept;
+        for (int i = 0; i < 30000; ++i) all.push_back(sparse.create_list(i + 1000000, std::string_view{text}));
+        for (size_t i = 0; i < all.size(); ++i) {
+            if (i % 50 == 0) kept.push_back(all[i]); else sparse.deref(std::move(all[i]));
+        }
+        std::vector<std::string> expect;
+        std::vector<Buddy::Ref*> roots;
+        for (auto& r : kept) {
+            expect.push_back(to_string(sparse, r));
+            roots.push_back(&r);
+        }
+        const size_t live{sparse.GetStats().live_chunks()};
+        auto res = sparse.Compact(roots);
+        assert(res.moved_chunks > 0 && res.blocks_emptied > 0);
+        assert(sparse.GetStats().live_chunks() == live);
+        for (size_t i = 0; i < kept.size(); ++i) assert(to_string(sparse, kept[i]) == expect[i]);
+        for (auto& r : kept) sparse.deref(std::move(r));
+        assert(sparse.GetStats().live_chunks() == 0);
+    }
+
+    {
+        // a slice reads its own bytes of a LARGE or OWNED parent wherever
+        // the parent or the slice ends up
+        std::string large_text(1000, ' '), owned_text(Buddy::Allocator::MAX_LARGE_ATOM + 1000, ' ');
+        for (size_t i = 0; i < large_text.size(); ++i) large_text[i] = static_cast<char>('a' + i % 26);
+        for (size_t i = 0; i < owned_text.size(); ++i) owned_text[i] = static_cast<char>('A' + i % 23);
+        auto bytes = [](Buddy::Allocator& a, Buddy::Ref ref) {
+            std::string got;
+            a.ForEachPiece(ref, [&](std::span<const uint8_t> sp) { got.append(sp.begin(), sp.end()); });
+            return got;
+        };
+        auto check = [&](Buddy::Allocator& a, Buddy::Ref slice, const std::string& text, uint32_t offset) {
+            assert(bytes(a, slice) == text.substr(offset, 100));
+        };
+        const std::string* texts[] = {&large_text, &owned_text};
+        const uint32_t offsets[] = {17, Buddy::Allocator::MAX_LARGE_ATOM};
+
+        // promoted out of a region
+        for (int k = 0; k < 2; ++k) {
+            Buddy::Allocator promoting;
+            promoting.BeginRegion();
+            Buddy::Ref parent = promoting.create(std::string_view{*texts[k]});
+            Buddy::Ref slice = promoting.create_slice(parent, offsets[k], 100);
+            promoting.deref(std::move(parent));
+            slice = promoting.EndRegion(std::move(slice));
+            check(promoting, slice, *texts[k], offsets[k]);
+            promoting.deref(std::move(slice));
+            assert(promoting.GetStats().live_chunks() == 0);
+        }
+
+        // moved by Compact, with the parent kept alive only by its slices
+        // or also by a root of its own
+        for (int k = 0; k < 2; ++k) {
+            Buddy::Allocator moving;
+            std::vector<Buddy::Ref> all, kept;
+            std::vector<std::string> all_expect, expect;
+            size_t parent{0};
+            for (int i = 0; i < 20000; ++i) {
+                // OWNED parents are big, so are each sliced many times
+                if (k == 0 || i % 1000 == 0) {
+                    parent = all.size();
+                    all.push_back(moving.create(std::string_view{*texts[k]}));
+                    all_expect.push_back(*texts[k]);
+                }
+                all.push_back(moving.create_slice(all[parent], offsets[k] + i % 7, 100));
+                all_expect.push_back(texts[k]->substr(offsets[k] + i % 7, 100));
+            }
+            for (size_t i = 0; i < all.size(); ++i) {
+                if (i % 49 == 0) {
+                    kept.push_back(all[i]);
+                    expect.push_back(all_expect[i]);
+                } else {
+                    moving.deref(std::move(all[i]));
+                }
+            }
+            std::vector<Buddy::Ref*> roots;
+            for (auto& r : kept) roots.push_back(&r);
+            auto res = moving.Compact(roots);
+            assert(res.moved_chunks > 0);
+            for (size_t i = 0; i < kept.size(); ++i) assert(bytes(moving, kept[i]) == expect[i]);
+            for (auto& r : kept) moving.deref(std::move(r));
+            assert(moving.GetStats().live_chunks() == 0);
+        }
+
+        // saved and loaded, when the parent's data moves into the snapshot
+        for (int k = 0; k < 2; ++k) {
+            const std::string path{std::filesystem::temp_directory_path() / "bll-test.snapshot"};
+            Buddy::Allocator source;
+            Buddy::Ref parent = source.create(std::string_view{*texts[k]});
+            Buddy::Ref saved = source.create_slice(parent, offsets[k], 100);
+            source.deref(std::move(parent));
+            bool ok = source.SaveSnapshot(path, std::span{&saved, 1});
+            assert(ok);
+            source.deref(std::move(saved));
+
+            Buddy::Allocator loaded;
+            auto roots = loaded.LoadSnapshot(path);
+            std::filesystem::remove(path);
+            assert(roots && roots->size() == 1);
+            check(loaded, roots->front(), *texts[k], offsets[k]);
+            loaded.deref(std::move(roots->front()));
+            assert(loaded.GetStats().live_chunks() == 0);
+        }
+
+        // of a parent in a prelude
+        auto prelude = Buddy::Prelude::Build([&](Buddy::Allocator& a) {
+            return std::vector<Buddy::Ref>{a.create(std::string_view{large_text}), a.create(std::string_view{owned_text})};
+        });
+        Buddy::Allocator user{prelude};
+        for (int k = 0; k < 2; ++k) {
+            Buddy::Ref slice = user.create_slice(prelude->roots()[k], offsets[k], 100);
+            check(user, slice, *texts[k], offsets[k]);
+            user.deref(std::move(slice));
+        }
+        assert(user.GetStats().live_chunks() == 0);
+    }
+
+    {
+        // interned conses still dedup, and are forgotten once freed, after
+        // Compact has moved them and their children
+        Buddy::Allocator interning;
+        interning.SetInterning(true);
+        const size_t empty{interning.GetStats().live_chunks()};
+        static const std::string pad(200, 'i');
+        auto make = [&](int i) {
+            std::string name = std::to_string(i) + pad;
+            return interning.create_cons(interning.create(std::string_view{name}), interning.create_cons(interning.create(i + 1000000), interning.nil()));
+        };
+        std::vector<Buddy::Ref> all, kept;
+        for (int i = 0; i < 30000; ++i) all.push_back(make(i));
+        for (size_t i = 0; i < all.size(); ++i) {
+            if (i % 60 == 0) kept.push_back(all[i]); else interning.deref(std::move(all[i]));
+        }
+        std::vector<Buddy::Ref*> roots;
+        for (auto& r : kept) roots.push_back(&r);
+        auto res = interning.Compact(roots);
+        assert(res.moved_chunks > 0);
+        for (size_t i = 0; i < kept.size(); ++i) {
+            Buddy::Ref again = make(static_cast<int>(i * 60));
+            assert(again == kept[i]);
+            interning.deref(std::move(again));
+        }
+        for (auto& r : kept) interning.deref(std::move(r));
+        assert(interning.InternedCount() == 0);
+        assert(interning.GetStats().live_chunks() == empty);
+    }
 }
 
 void test10(Buddy::Allocator& raw_alloc)
@@ -245,6 +492,95 @@ void test11(Buddy::Allocator& raw_alloc)
     run(p);
     alloc.DumpChunks();
 
+    {
+        // ADD keeps its running total when adding negatives, and fails on
+        // overflow either way
+        auto finish = [](Execution::Program& p) {
+            while (!p.finished()) p.step();
+            return p.inspect_feedback();
+        };
+        Execution::Program plus{alloc, list(OP_ADD, q(5), q(-1)), list()};
+        auto n = finish(plus).convert<int64_t>();
+        assert(n && *n == 4);
+        Execution::Program over{alloc, list(OP_ADD, q(std::numeric_limits<int64_t>::max()), q(1)), list()};
+        assert(finish(over).is_error());
+        Execution::Program under{alloc, list(OP_ADD, q(std::numeric_limits<int64_t>::min()), q(-1)), list()};
+        assert(finish(under).is_error());
+
+        // totals crossing what a FUNC_NUM holds unboxed, either way, are
+        // boxed and unboxed again without losing count
+        const int64_t limit{int64_t{1} << (Buddy::TagView<Buddy::Tag::FUNC_NUM,16>::BITS - 1)};
+        for (bool region : {false, true}) {
+            Execution::Program across{alloc, list(OP_ADD, q(limit - 1), q(1), q(1), q(-3), q(-2 * limit), q(3)), list(), region};
+            auto total = finish(across).convert<int64_t>();
+            assert(total && *total == -limit + 1);
+        }
+    }
+
+    {
+        // op args skip BLLEVAL when it would answer at once, so they must
+        // give what going through BLLEVAL gives, errors included; the
+        // top-level sexpr always goes through BLLEVAL; the skipped steps are
+        // still charged, so wrapping any arg in RC costs the same
+        auto eval = [&](SafeRef&& sexpr) {
+            Execution::Program p{alloc, std::move(sexpr), list(list(1, 2), 3, 4)};
+            auto res = p.run();
+            assert(res.finished);
+            return std::pair{res.error ? std::string{"error"} : res.value.to_string(), res.cost};
+        };
+        std::optional<uint64_t> wrapping;
+        auto agree = [&](auto&& expr) {
+            const auto via{eval(alloc.create(expr))};
+            const auto skipped{eval(list(OP_RC, expr))};
+            assert(via.first == skipped.first);
+            if (via.first != "error") {
+                if (!wrapping) wrapping = skipped.second - via.second;
+                assert(skipped.second - via.second == *wrapping);
+            }
+            return via.first;
+        };
+        assert(agree(0) == alloc.nil().to_string());
+        assert(agree(2) == "(1 2)");
+        assert(agree(5) == "3");
+        assert(agree(7) == "(4)");
+        assert(agree(16) == "error");
+        assert(agree(-1) == "error");
+        assert(agree(q(7)) == "7");
+    }
+
+    {
+        // a run stopped at max_steps resumes where it left off, and the
+        // two runs together report what one run does
+        auto make = [&]() {
+            return list(OP_RC, 0, list(OP_ADD, q(1), list(OP_STRLEN, 2)), list(OP_CAT, q("ab"), list(OP_CAT, 5, q("cd"))));
+        };
+        Execution::Program whole{alloc, make(), list("xyz", "uv")};
+        auto all = whole.run();
+        assert(all.finished && !all.error && all.steps > 4);
+        const std::string expect{all.value.to_string()};
+
+        Execution::Program halves{alloc, make(), list("xyz", "uv")};
+        auto first = halves.run(4);
+        assert(!first.finished && !first.error && first.value.is_null());
+        assert(first.steps == 4 && first.max_depth <= all.max_depth);
+        auto second = halves.run();
+        assert(second.finished && !second.error && second.value.to_string() == expect);
+        assert(first.steps + second.steps == all.steps);
+        assert(std::max(first.max_depth, second.max_depth) == all.max_depth);
+        assert(first.allocations + second.allocations == all.allocations);
+        assert(second.cost == all.cost);
+
+        auto again = halves.run();
+        assert(again.finished && again.steps == 0 && again.allocations == 0);
+
+        // stopping short of an error doesn't report it
+        Execution::Program failing{alloc, list(OP_ADD, q(1), q(2), 8), list()};
+        auto before = failing.run(2);
+        assert(!before.finished && !before.error);
+        auto after = failing.run();
+        assert(after.finished && after.error);
+    }
+
     Execution::Program x{alloc, list(OP_X, q(1), q(2)), list()};
     run(x);
     alloc.DumpChunks();
@@ -312,6 +648,113 @@ void test11(Buddy::Allocator& raw_alloc)
     run(byteop);
     alloc.DumpChunks();
 
+    {
+        // fold state held only by the func being stepped is updated in
+        // place, so further args allocate nothing; state held elsewhere too
+        // is left as it was
+        auto bytes = [](SafeView v) {
+            auto sp = v.convert<std::span<const uint8_t>>();
+            assert(sp);
+            return std::string(sp->begin(), sp->end());
+        };
+        auto finish = [](Execution::Program& p) {
+            while (!p.finished()) p.step();
+            return p.inspect_feedback();
+        };
+        auto allocations = [&](SafeRef&& sexpr) {
+            Execution::Program p{alloc, std::move(sexpr), list()};
+            auto res = p.run();
+            assert(res.finished && !res.error);
+            return res.allocations;
+        };
+        assert(allocations(list(OP_XOR_BYTES, q(0x0f0f), q(0x3333), q(0x5555))) == allocations(list(OP_XOR_BYTES, q(0x0f0f), q(0x3333), q(0x5555), q(0x0ff0), q(0x00ff))));
+        assert(allocations(list(OP_CAT, q("ab"), q("cd"), q("ef"))) == allocations(list(OP_CAT, q("ab"), q("cd"), q("ef"), q("gh"), q("ij"))));
+        assert(allocations(list(OP_PARTIAL, list(OP_PARTIAL, q(OP_XOR_BYTES), q(0x0f0f), q(0x3333)))) == allocations(list(OP_PARTIAL, list(OP_PARTIAL, q(OP_XOR_BYTES), q(0x0f0f), q(0x3333), q(0x5555), q(0x0ff0)))));
+
+        static const std::string text(100, 'x');
+        SafeRef shared = alloc.create(std::string_view{text});
+        Execution::Program cat{alloc, list(OP_CAT, 1, q("yz")), shared.copy()};
+        assert(bytes(finish(cat)) == text + "yz");
+        assert(bytes(shared) == text);
+
+        // a func reached through the env is shared, so partially applying
+        // it copies its state rather than updating it
+        Execution::Program mk{alloc, list(OP_PARTIAL, q(OP_XOR_BYTES), q(std::string_view{text})), list()};
+        SafeRef func = finish(mk).copy();
+        std::string expect{text};
+        expect[0] ^= 'y';
+        expect[1] ^= 'z';
+        for (int i = 0; i < 2; ++i) {
+            Execution::Program xorop{alloc, list(OP_PARTIAL, list(OP_PARTIAL, 1, q("yz"))), func.copy()};
+            assert(bytes(finish(xorop)) == expect);
+        }
+        Execution::Program unchanged{alloc, list(OP_PARTIAL, 1), func.copy()};
+        assert(bytes(finish(unchanged)) == text);
+    }
+
+    {
+        // a func referenced twice is stepped on from the same state each time
+        Execution::Program mk{alloc, list(OP_PARTIAL, q(OP_ADD), q(5)), list()};
+        SafeRef func = mk.run().value.copy();
+        for (bool region : {false, true}) {
+            Execution::Program twice{alloc, list(OP_RC, 0, list(OP_PARTIAL, list(OP_PARTIAL, 1, q(1))), list(OP_PARTIAL, list(OP_PARTIAL, 1, q(2)))), func.copy(), region};
+            assert(twice.run().value.to_string() == "(7 6)");
+        }
+
+        // and a region never updates a main heap func, even one held once
+        Buddy::Ref lone = raw_alloc.create_func(OP_ADD, raw_alloc.nil(), int64_t{5});
+        assert(raw_alloc.can_update_func(lone));
+        raw_alloc.BeginRegion();
+        assert(!raw_alloc.can_update_func(lone));
+        raw_alloc.EndRegion(Buddy::NULLREF);
+        raw_alloc.deref(std::move(lone));
+    }
+
+    Execution::Program regionop{alloc,
+         list(OP_RC, 0, list(OP_CAT, q("hello "), list(OP_SUBSTR, q(xxx), q(90))), list(OP_SHA256, q(xxx))),
+         list(), /*region=*/true};
+    run(regionop);
+    alloc.DumpChunks();
+
+    {
+        // ropes share pieces, so doubling an atom is cheap, but lengths past
+        // MAX_ATOM_SIZE are errors rather than wrapping
+        static const std::string text(128, 'd');
+        auto doubled = [&](int times) {
+            SafeRef e = alloc.create(q(std::string_view{text}));
+            for (int i = 0; i < times; ++i) e = list(OP_APPLY, q(list(OP_CAT, 1, 1)), std::move(e));
+            return e;
+        };
+        Execution::Program fits{alloc, list(OP_STRLEN, doubled(24)), list()};
+        while (!fits.finished()) fits.step();
+        auto len = fits.inspect_feedback().convert<int64_t>();
+        assert(len && *len == int64_t{128} << 24);
+        Execution::Program toolong{alloc, list(OP_STRLEN, doubled(25)), list()};
+        while (!toolong.finished()) toolong.step();
+        assert(toolong.inspect_feedback().is_error());
+
+        // building a 128 MiB rope fits the budget, but hashing it doesn't,
+        // so that fails before any hashing is done
+        const uint64_t budget{uint64_t{1} << 29};
+        Execution::Program hashop{alloc, list(OP_SHA256, doubled(20)), list(), /*region=*/false, budget};
+        auto hashed = hashop.run();
+        assert(hashed.finished && hashed.error);
+        assert(hashed.cost > budget && hashed.cost >= (uint64_t{128} << 20) * Execution::Cost::HASH_BYTE);
+    }
+
+    {
+        // malloc'd data made in a region is counted once, as it's promoted;
+        // the atom is bigger than any block so is malloc'd in every build
+        const size_t malloc_bytes{raw_alloc.GetStats().malloc_bytes};
+        raw_alloc.BeginRegion();
+        static const std::string text(600000, 'b');
+        Buddy::Ref big = raw_alloc.create(std::string_view{text});
+        big = raw_alloc.EndRegion(std::move(big));
+        assert(raw_alloc.GetStats().malloc_bytes == malloc_bytes + text.size());
+        raw_alloc.deref(std::move(big));
+        assert(raw_alloc.GetStats().malloc_bytes == malloc_bytes);
+    }
+
     assert(env.is_null());
     assert(one.is_null());
     assert(sexpr.is_null());
@@ -338,5 +781,6 @@ int main(void)
     alloc.DumpChunks();
     test11(alloc);
     alloc.DumpChunks();
+    std::cout << Buddy::to_string(alloc.GetStats()) << std::endl;
     return 0;
 }
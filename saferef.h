@@ -60,6 +60,8 @@ public:
         SafeAllocator& Allocator() const { return m_safealloc; }
         SafeRef copy() const { return SafeRef{m_safealloc, m_safealloc.m_alloc.bumpref(m_ref)}; }
         Ref take() { return m_ref.take(); }
+        // for passing to Allocator::Compact
+        Ref* root() LIFETIMEBOUND { return &m_ref; }
 
         SafeRef nullref() const { return m_safealloc.nullref(); }
         bool is_null() const { return m_ref.is_null(); }
@@ -177,6 +179,11 @@ public:
         return make_safe(m_alloc.create<Buddy::Tag::CONS,16>({.left=l, .right=r}));
     }
 
+    SafeRef create_slice(const SafeView& parent, uint32_t offset, uint32_t size)
+    {
+        return make_safe(m_alloc.create_slice(parent.take_view(), offset, size));
+    }
+
     std::pair<SafeRef, std::span<uint8_t>> create_writable_span(uint32_t size)
     {
         auto [ref, sp] = m_alloc.create_writable_span(size);
@@ -302,6 +309,7 @@ public:
 
     explicit ConvertRef(SafeRef&& _ref) : ref{std::move(_ref)}, atom{std::nullopt}
     {
+        ref.Allocator().Allocator().Flatten(SafeView{ref}.take_view());
         ref.dispatch(util::Overloaded(
             [&]<size_t SIZE>(const TagView<Tag::INPLACE_ATOM,SIZE>& atomin) {
                 atom = atomin.span();
@@ -309,6 +317,12 @@ public:
             [&](const TagView<Tag::OWNED_ATOM,16>& atomown) {
                 atom = atomown.span();
             },
+            [&](const TagView<Tag::LARGE_ATOM,16>& atomlarge) {
+                atom = atomlarge.span();
+            },
+            [&](const TagView<Tag::SLICE,32>& slice) {
+                atom = slice.span(); // ref keeps the parent alive too
+            },
             [&](const TagView<Tag::EXT_ATOM,16>& atomext) {
                 atom = atomext.span();
                 ref = ref.nullref(); // free
@@ -321,6 +335,7 @@ public:
 
     explicit ConvertRef(const SafeView& view) : ref{view.Allocator().nullref()}, atom{std::nullopt}
     {
+        view.Allocator().Allocator().Flatten(view.take_view());
         view.dispatch(util::Overloaded(
             [&]<AtomicTagView ATV>(const ATV& atomatv) {
                 atom = atomatv.span();
@@ -354,8 +369,11 @@ public:
         if (v.has_value()) ref = ref.nullref(); // free ref
     }
 
-    explicit ConvertRef(const SafeView& view) : v{std::nullopt}
+    explicit ConvertRef(const SafeView& view) : v{view.take_view().immediate()}
     {
+        if (v.has_value()) return;
+        // a rope is too long to be a minimally encoded int64_t, so is not
+        // flattened just to fail
         view.dispatch(util::Overloaded(
             [&]<AtomicTagView ATV>(const ATV& atom) {
                 v = Buddy::SmallInt(atom.span());